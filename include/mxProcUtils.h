@@ -11,6 +11,7 @@
 #ifndef MXPROCUTILS_H
 #define MXPROCUTILS_H
 
+#include <stdio.h>
 #include <elf.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -24,6 +25,8 @@
 #define Elf_Dyn  Elf64_Dyn
 #define Elf_Addr Elf64_Addr
 #define Elf_Off  Elf64_Off
+#define Elf_Word Elf64_Word
+#define ELF_ST_TYPE ELF64_ST_TYPE
 // 64bit implimentations only use 48bit addressing at this stage
 #define FMT_ADR "0x%012lx"
 #else
@@ -35,6 +38,8 @@
 #define Elf_Dyn  Elf32_Dyn
 #define Elf_Addr Elf32_Addr
 #define Elf_Off  Elf32_Off
+#define Elf_Word Elf32_Word
+#define ELF_ST_TYPE ELF32_ST_TYPE
 #define FMT_ADR "0x%08lx"
 #endif
 
@@ -54,6 +59,15 @@ typedef enum
 }
 mxProcType;
 
+typedef enum
+{
+   mxAttachStop = 0,     // Keep a live process stopped until it is closed
+   mxAttachSnapshot,     // Copy the stacks (and snapshot ranges) of a live process, then let it run
+   mxAttachNone,         // Never stop a live process.  Its LWPs are listed without their registers.
+   mxAttachPassive       // Copy the stacks of blocked LWPs without stopping them, only stopping running LWPs briefly
+}
+mxAttachMode;
+
 typedef struct
 {
    int lwpID;
@@ -62,6 +76,7 @@ typedef struct
    Elf_Addr ip;
    Elf_Addr stack;
    size_t stacksize;
+   int stopSignal;          // Signal to pass on when detaching from a live LWP
 }
 mxLWP_t;
 
@@ -79,9 +94,31 @@ typedef struct
    const Elf_Sym *table;
    int size;
    Elf_Addr baseAddr;
+   int elfID;                   // File the table was loaded from
+   Elf_Word type;               // SHT_SYMTAB or SHT_DYNSYM
+   const Elf_Word *gnuHash;     // .gnu.hash section for this table, if any
+   const Elf_Word *sysvHash;    // .hash section for this table, if any
 }
 mxSymTab_t;
 
+// Address sorted, non-overlapping ranges of the symbols in all symbol tables, see buildSymbolIndex()
+typedef struct
+{
+   Elf_Addr start;
+   Elf_Addr end;
+   Elf_Addr value;              // Address of the symbol, which may be before start
+   Elf_Word name;               // Offset of the name in the strings of the table
+   int table;
+}
+mxSymbolRange_t;
+
+typedef struct
+{
+   int n;
+   mxSymbolRange_t *range;
+}
+mxSymbolIndex_t;
+
 union mxArgValue
 {
    unsigned long val; // Default
@@ -98,7 +135,7 @@ typedef struct
    union mxArgValue val;
    Elf_Addr addr;
    int size; // 1, 2, 4 or 8 bytes are supported
-   char *type;
+   const char *type;
 }
 mxArgument;
 
@@ -110,34 +147,76 @@ typedef struct
 mxInstTagAddr;
 
 #define MAX_ARGS 100
+#define MIN_MERGED_ARGS 4 // Handlers read arg[0] to arg[2] without checking count, so arg[] always has this many entries
+// The arrays are allocated from a per-thread arena as they are filled, see reserveArguments().
+// They used to be inline arrays of MAX_ARGS entries, so code built against the old layout, such as
+// printer extensions loaded with -L, must be rebuilt.
 typedef struct
 {
    // Arguments from instrumentation
-   mxArgument instArg[MAX_ARGS];
+   mxArgument *instArg;
    mxInstTagAddr instAddr;
    int instCount;
    // Arguments passed on the stack
-   mxArgument stackArg[MAX_ARGS];
+   mxArgument *stackArg;
    int stackCount;
    // Arguments passed on integer registers.  Only used on x86 64bit.
-   mxArgument intArg[MAX_ARGS];
+   mxArgument *intArg;
    int intCount;
    // Arguments passed on float registers  Only used on x86 64bit.
-   mxArgument floatArg[MAX_ARGS];
+   mxArgument *floatArg;
    int floatCount;
 
-   // Merged list of arguments, including type information
-   mxArgument arg[MAX_ARGS];
+   // Merged list of arguments, including type information.  arg[count] up to arg[MIN_MERGED_ARGS-1] are always zeroed.
+   mxArgument *arg;
    int count;
 
+   // Size of each array
+   int maxInstArgs;
+   int maxStackArgs;
+   int maxIntArgs;
+   int maxFloatArgs;
+   int maxArgs;
 }
 mxArguments;
 
-#define MAX_LWPS 1000
-typedef mxLWP_t mxLWPs_t[MAX_LWPS];
+// Where a function's prologue saves its register arguments, relative to the frame pointer.
+// Code doesn't change, so this is decoded once per function and cached per mxProc.
+#define MAX_PROLOGUE_SLOTS 16
+typedef struct
+{
+   int argNo;
+   int isFloat;
+   int size;
+   long offset;
+}
+mxPrologueSlot_t;
+
+typedef struct
+{
+   Elf_Addr function;           // Start of the function, 0 if the entry is unused
+   int nSlots;
+   mxPrologueSlot_t slot[MAX_PROLOGUE_SLOTS];
+}
+mxPrologue_t;
+
+typedef struct
+{
+   unsigned int mask;           // Number of entries - 1, always a power of 2 minus 1
+   unsigned int n;
+   mxPrologue_t *entry;
+}
+mxPrologueCache_t;
 
-#define MAX_SYMTABS 2000
-typedef mxSymTab_t mxSymTabs_t[MAX_SYMTABS];
+// One of a set of reads passed to readMxProcVMBatch
+typedef struct
+{
+   Elf_Addr vmAddr;
+   size_t size;
+   void *buff;
+   int status;          // Set to the result of reading this request, as readMxProcVM
+}
+mxReadRequest;
 
 typedef struct
 {
@@ -150,25 +229,215 @@ typedef struct
 }
 mxElfFile;
 
-#define MAX_ELF_FILES 512
+// A resolved range of VM addresses.  Ranges in an index are sorted and never overlap.
+typedef struct
+{
+   Elf_Addr start;        // First VM address of the range
+   Elf_Addr end;          // First VM address after the range
+   Elf_Addr fileAddr;     // File offset of start, or ADDR_NULLVALUES for the unused tail of a segment
+   int elfID;             // Elf file providing the data
+}
+mxSegment_t;
+
+typedef struct
+{
+   int n;
+   mxSegment_t *seg;
+}
+mxSegmentIndex_t;
+
+// Large files (i.e. the core) are mapped lazily in windows of this size.  The least recently used
+// window is unmapped once MAX_FILE_WINDOWS are in use.
+#if defined (_LP64)
+#define FILE_WINDOW_SIZE (64UL * 1024 * 1024)
+#define MAX_FILE_WINDOWS 32
+#else
+#define FILE_WINDOW_SIZE (4UL * 1024 * 1024)
+#define MAX_FILE_WINDOWS 16
+#endif
+
+typedef struct
+{
+   int elfID;
+   Elf_Off offset;        // File offset of the window, a multiple of FILE_WINDOW_SIZE
+   size_t size;
+   char *mmloc;
+   unsigned long lastUsed;
+   int refs;              // Readers still copying from the window, which can't be unmapped until they are done
+}
+mxFileWindow_t;
+
+typedef struct
+{
+   int nWindows;
+   unsigned long clock;
+   mxFileWindow_t window[MAX_FILE_WINDOWS];
+}
+mxFileWindows_t;
+
+// Blocks of a live process's memory, see readCachedVM().  Each LWP keeps copies of the last few
+// blocks it used, in front of a shared cache of up to maxBlocks, which reuses the least recently used.
+#define PAGE_CACHE_BLOCK 4096
+#define PAGE_CACHE_L1_BLOCKS 16
+#define DEFAULT_PAGE_CACHE_BLOCKS 2048
+#define MAX_PAGE_CACHE_BLOCKS (1 << 20)
+
+typedef struct mxCacheBlock
+{
+   Elf_Addr addr;
+   struct mxCacheBlock *hashNext;
+   struct mxCacheBlock *newer;
+   struct mxCacheBlock *older;
+   char *data;
+}
+mxCacheBlock_t;
+
+typedef struct
+{
+   int maxBlocks;               // 0 if the cache is disabled
+   int nBlocks;
+   mxCacheBlock_t *block;       // Allocated when the first block is added
+   char *data;
+   unsigned int hashMask;       // Hash table size - 1, always a power of 2 minus 1
+   mxCacheBlock_t **hash;
+   mxCacheBlock_t *newest;
+   mxCacheBlock_t *oldest;
+   unsigned long generation;    // Changed whenever the cache is invalidated, so LWP copies can tell they are stale
+   unsigned long l1Hits;
+   unsigned long l2Hits;
+   unsigned long misses;
+}
+mxPageCache_t;
+
+// Copy of the stack of the LWP being unwound, so repeated reads of the same words don't go back to the core/process.
+// Only the part from just below sp to the top of the stack mapping is copied, up to MAX_STACK_SNAPSHOT bytes.
+#define MAX_STACK_SNAPSHOT (64UL * 1024 * 1024)
+typedef struct
+{
+   Elf_Addr start;
+   size_t size;
+   char *data;
+}
+mxStackSnapshot_t;
+
+// Memory copied from a live process before detaching from it, see mxAttachSnapshot.  Sorted by start address.
+typedef struct
+{
+   int nRegions;
+   mxStackSnapshot_t *region;
+}
+mxMemorySnapshot_t;
+
+// Blocks of memory which are freed together
+typedef struct mxArenaBlock
+{
+   struct mxArenaBlock *next;
+   size_t used;
+   size_t size;
+}
+mxArenaBlock_t;
+
+typedef struct
+{
+   mxArenaBlock_t *head;
+}
+mxArena_t;
+
+// Hash of demangled symbol names, without arguments, to addresses.  Built by getSymbolAddress() the first time a
+// qualified name is looked up, and extended with symbol tables loaded since.
+typedef struct
+{
+   const char *name;
+   Elf_Addr addr;
+   int symtab;                  // Symbol table the name was found in
+}
+mxNameEntry_t;
+
+typedef struct
+{
+   int nIndexedSymtabs;         // Symbol tables indexed so far
+   unsigned int nNames;
+   unsigned int mask;           // Number of entries - 1, always a power of 2 minus 1
+   mxNameEntry_t *entry;
+   mxArena_t names;             // Demangled names
+}
+mxNameIndex_t;
+
+// A demangled prototype, parsed once per symbol.  See getPrototype().
+typedef struct
+{
+   const char *functionName;        // Without return type or arguments, as get_function_name_from_prototype()
+   const char *shortFunctionName;   // Without scope
+   int isOperator;
+   const char *thisType;            // "Class*" if functionName has a scope, otherwise NULL
+   int foundArguments;              // The argument list was found in the prototype
+   int nArgs;
+   const char **argTypes;           // Interned, with spaces and const removed
+}
+mxPrototype_t;
+
+// Demangled symbol names, keyed by the address of the symbol name.  See getDemangledName().
+typedef struct
+{
+   const char *symbol;
+   const char *demangled;
+   const mxPrototype_t *prototype;  // Parsed on first use
+}
+mxDemangleEntry_t;
+
+typedef struct
+{
+   unsigned int mask;           // Number of entries - 1, always a power of 2 minus 1
+   unsigned int n;              // Entries in use
+   mxDemangleEntry_t *entry;
+   mxArena_t names;             // Demangled names and prototypes
+   unsigned long hits;
+   unsigned long misses;
+
+   unsigned int typeMask;       // Interned argument types, also a power of 2 minus 1
+   unsigned int nTypes;
+   const char **types;
+}
+mxDemangleCache_t;
+
 typedef struct
 {
    mxProcType type;
 
-   // Symbol Tables
-   mxSymTabs_t symtab;
+   // Symbol Tables.  The arrays below grow as they are filled, see growArray()
+   mxSymTab_t *symtab;
    int nsymtabs;
+   int maxSymtabs;
+   int nIndexedSymtabs;             // nsymtabs when the index was built, 0 if not built
+   mxSymbolIndex_t symbolIndex;
 
    // For Elf files
    int elfOpen;
-   mxElfFile elfFile[MAX_ELF_FILES];
+   int maxElfFiles;
+   mxElfFile *elfFile;
+
+   // Segment lookup indexes, see buildSegmentIndex()
+   int nIndexedElfs;                // elfOpen when the indexes were built, 0 if not built
+   mxSegmentIndex_t coreFirstIndex;
+   mxSegmentIndex_t coreLastIndex;
+   mxSegmentIndex_t *fileIndex;     // One per elf file, for COREONLY and FILEONLY
+   mxSegmentIndex_t readOnlyIndex;  // Read only file data a live process can be read from, see readMxProcVM()
+
+   mxFileWindows_t *windows;        // Mapped windows of files read with readFile()
+   mxNameIndex_t *nameIndex;        // Demangled names, see getSymbolAddress()
+   mxDemangleCache_t *demangleCache;
+   mxPrologueCache_t *prologueCache;
+   mxPageCache_t *pageCache;        // Blocks read from a live process, see readCachedVM()
 
    // For PID
    int as;                      // file descriptor pointing to the address space
    pid_t pid;                   // PID of process
+   int attached;                // The LWPs are stopped, see detachMxProcPID()
+   mxMemorySnapshot_t *memorySnapshot;
 
    int nLWPs;
-   mxLWPs_t LWPs;
+   int maxLWPs;
+   mxLWP_t *LWPs;
 
    char filePrefix[LINE_BUFFER_SIZE];      // If we want to dump some output to files, we can use this for the prefix
    char binFile[LINE_BUFFER_SIZE];         // Detected binary name
@@ -177,11 +446,18 @@ mxProc;
 
 // Public API
 mxProc *openCoreFile(const char *binFileName, const char *coreFileName, const char *libraryRoot, int plddMode);
-mxProc *openPID(const char *binFileName, const char *PID, int plddMode);
+mxProc *openPID(const char *binFileName, const char *PID, int plddMode, mxAttachMode mode, int lwp);
 void closeMxProc(mxProc *p);
+void addSnapshotRange(Elf_Addr start, size_t size);
+void setPageCacheSize(long blocks);
+void invalidatePageCache(const mxProc *p);
 
 void printCallStack(const mxProc *p, mxLWP_t t, int fullStack, int stackArguments, int corruptStackSearch);
+int getCallStack(const mxProc *p, mxLWP_t t, int corruptStackSearch, Elf_Addr *frames, int maxFrames);
 void dumpStack(const mxProc *p, mxLWP_t t, int words);
+void snapshotStack(const mxProc *p, mxLWP_t t);
+void releaseStackSnapshot();
+void setStackSnapshot(Elf_Addr start, const void *data, size_t size);
 Elf_Addr getSymbolAddress(const mxProc * c, const char *symbolName);
 void printpmap(mxProc *c);
 
@@ -190,40 +466,82 @@ long read_long(const mxProc *p, Elf_Addr vmAddr);
 Elf_Addr read_addr(const mxProc *p, Elf_Addr vmAddr);
 double read_double(const mxProc *p, Elf_Addr vmAddr);
 void read_string(const mxProc *p, Elf_Addr vmAddr, char *buf, size_t buf_length);
+size_t read_string_part(const mxProc *p, Elf_Addr vmAddr, char *buf, size_t size, int *complete);
 void read_bytes(const mxProc *p, Elf_Addr vmAddr, void *buf, size_t buf_length);
 
 // Debugging
 void setVerbose(int v);
+void setOutputFile(FILE *fp);
+FILE *getOutputFile();
 void debug(const char *format, ...);
 void warning(const char *format, ...);
 void fatal_error(const char *format, ...);
 
-char *get_function_name_from_prototype(char *name);
+char *get_function_name_from_prototype(const char *name);
+const char *getDemangledName(const mxProc *p, const char *symbolName);
+const mxPrototype_t *getPrototype(const mxProc *p, const char *symbolName);
+int getCachedPrologue(const mxProc *p, Elf_Addr function, mxPrologue_t *prologue);
+void cachePrologue(const mxProc *p, const mxPrologue_t *prologue);
 
 
 // Functions requires for OS/Arch specific code
 void initMxProc(mxProc *m);
+void *growArray(void *array, int *maxItems, size_t itemSize, int nItems);
+mxLWP_t *addLWP(mxProc *p);
 void loadSymbols(mxProc * p, int elfID, Elf_Addr baseAddr);
 void loadLibraries(mxProc * p, int elfID, const char *libraryFile, int plddMode);
 void readFile(const mxProc * c, int elfID, Elf_Addr fileAddr, void *buffPointer, size_t size);
+int readFileMapped(const mxProc * c, int elfID, Elf_Addr fileAddr, void *buffPointer, size_t size);
+int readCoreVM(const mxProc *p, Elf_Addr vmAddr, void *buffPointer, size_t size);
+void adviseMxProcVM(const mxProc *p, Elf_Addr vmAddr, size_t size);
+int readStackSnapshot(Elf_Addr vmAddr, void *buff, size_t size);
+void captureMemorySnapshot(mxProc *p);
+int copyStack(const mxProc *p, mxLWP_t t, mxStackSnapshot_t *region);
+void setMemorySnapshot(mxProc *p, mxMemorySnapshot_t *snapshot);
+int readMemorySnapshot(const mxProc *p, Elf_Addr vmAddr, void *buff, size_t size);
 
 enum {COREFIRST, CORELAST, COREONLY, FILEONLY};
 void getFileAddrFromCore(const mxProc *c, Elf_Addr vmAddr, Elf_Addr *fileAddr, int *elfFile, int so);
+void buildSegmentIndex(mxProc *c);
+void freeSegmentIndex(mxProc *c);
+void buildSymbolIndex(mxProc *c);
+void freeSymbolIndex(mxProc *c);
+
+// Called for each frame of a stack walk, with its return address.  Return non zero to stop the walk.
+typedef int mxFrameCallback(const mxProc *p, Elf_Addr addr, Elf_Addr frameAddr, void *arg);
+void walkCallStack(const mxProc *p, mxLWP_t t, int fullStack, int quiet, int corruptStackSearch, mxFrameCallback *callback, void *arg);
 
 void printStackItem(const mxProc *p, Elf_Addr addr, Elf_Addr argsAddr, int fullStack, int stackArguments);
+const char *getFunctionName(const mxProc *p, Elf_Addr addr);
 const char *getUnknownSymbol();
 int openElfFile(mxProc *c,  const char *fileName, Elf_Addr baseAddr, int justHeaders, int failIfInvalid);
 mxArguments *getArguments(const mxProc *proc, Elf_Addr disAddr, Elf_Addr frameAddr, int verbose);
+mxArguments *newArguments();
+void reserveArguments(mxArgument **array, int *maxArgs, int nArgs);
+void releaseArguments();
+void freeArgumentArena();
 void addInstrumentedArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_Addr argAddr, int argLength);
 void addStackArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_Addr argAddr, int argLength);
 void addIntArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_Addr argAddr, int argLength);
 void addFloatArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_Addr argAddr, int argLength);
+void addStackArguments(const mxProc *proc, mxArguments *args, Elf_Addr argAddr, int nArgs, int argLength);
+int readMxProcVM(const mxProc *p, Elf_Addr vmAddr, void *buff, size_t size);
+int readMxProcVMBatch(const mxProc *p, mxReadRequest *requests, int nRequests);
 
 // OS Specific functions
 void closeMxProcPID(mxProc *p);
-void getLWPsFromPID(mxProc *p);
+void detachMxProcPID(mxProc *p);
+void stopMxProcPID(mxProc *p, int lwp);
+
+// Called for each sample taken by samplePerfEvents(), with the stack of t readable as a stack snapshot
+typedef void mxSampleCallback(const mxProc *p, mxLWP_t t, void *arg);
+long samplePerfEvents(const mxProc *p, long intervalMs, long durationMs, mxSampleCallback *callback, void *arg);
+void getLWPsFromPID(mxProc *p, int lwp);
 void getLWPsFromCore(mxProc *p);
-int readMxProcVM(const mxProc *p, Elf_Addr vmAddr, void *buff, size_t size);
+int readVMFromPID(const mxProc *p, Elf_Addr vmAddr, void *buff, size_t size);
+int getVMRegionFromPID(const mxProc *p, Elf_Addr vmAddr, Elf_Addr *start, Elf_Addr *end);
+int isFileMappedAt(const mxProc *p, Elf_Addr start, Elf_Addr end, const mxstat *fileStat);
+int canReadFromAnyThread(const mxProc *p);
 void demangleSymbolName(const char *symbolName, char *demangled, int size);
 Elf_Addr processSignalHandler(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp, Elf_Addr curr_ret_addr, int fullStack);
 
@@ -13,6 +13,12 @@
 
 #include "mxProcUtils.h"
 
+// Version of the structures -L extensions are given, such as mxProc and mxArguments.  Bump it whenever
+// their layout changes.  Extensions export it by adding PMX_EXTENSION_ABI_VERSION; at file scope,
+// and are only loaded if it matches.  Extensions without it were built for version 1.
+#define PMX_EXTENSION_ABI 2
+#define PMX_EXTENSION_ABI_VERSION extern "C" const int pmx_extension_abi = PMX_EXTENSION_ABI
+
 typedef void StackHandler(const mxProc * proc, const char *name, const char *comment, Elf_Addr value);
 // Return 0 to continue processing function arguments by type, non-zero to not automatically process arguments
 typedef int FunctionHandler(const mxProc * proc, const char *name, const char *comment, mxArguments *args);
@@ -35,6 +41,13 @@ typedef struct
 void display_arguments(const mxProc *proc, const char *name, mxArguments *args);
 int print_mxargv(const mxProc *proc, Elf_Addr argc_addr, Elf_Addr argv, Elf_Addr argx);
 
+// Output of an item printed by a --jobs worker, to be written out in order by the main thread
+typedef struct pmxDeferredOutput pmxDeferredOutput_t;
+void startDeferredOutput(FILE *fp);
+pmxDeferredOutput_t *finishDeferredOutput();
+void emitDeferredOutput(const mxProc *proc, pmxDeferredOutput_t *output, FILE *out);
+void freePrintState();
+
 void setInlineMode(int mode);
 int getInlineMode();
 
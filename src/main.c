@@ -12,15 +12,588 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/resource.h>
 #include <getopt.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 #include "mxProcUtils.h"
 #include "pmx.h"
 
+#define MAX_GROUPED_FRAMES 1024
+
+// LWPs with the same return addresses on their stacks, see --group-stacks
+typedef struct
+{
+   unsigned int hash;
+   int nFrames;
+   Elf_Addr *frames;
+   int nLWPs;
+   int *lwps;            // Indexes into p->LWPs
+} pmxStackGroup_t;
+
+// Distinct stacks seen by --sample, keyed by their return addresses
+typedef struct
+{
+   unsigned int hash;
+   int nFrames;
+   Elf_Addr *frames;     // Innermost first
+   long count;
+} pmxSampledStack_t;
+
+typedef struct
+{
+   pmxSampledStack_t *stacks;
+   int nStacks;
+   int maxStacks;
+   int *table;           // Indexes into stacks, at most half full
+   unsigned int mask;
+   long nSamples;        // One per LWP per sample
+   int corruptStack;
+   Elf_Addr *frames;     // Where each stack is walked to
+} pmxSamples_t;
+
+// A line of --sample's folded output
+typedef struct
+{
+   char *line;           // Function names separated by ';', outermost first
+   long count;
+} pmxFoldedStack_t;
+
+// Time spent in a function over all the samples, see --sample
+typedef struct
+{
+   const char *name;
+   long self;            // Samples where it was the innermost frame
+   long total;           // Samples where it was anywhere on the stack
+} pmxFunctionCount_t;
+
+// The LWPs to print and how, shared by the threads unwinding them with --jobs
+typedef struct
+{
+   const mxProc *p;
+   int *lwps;            // Indexes into p->LWPs, in the order they are printed
+   int nLWPs;
+   int allThreads;
+   long dumpRawStack;
+   int printStack;
+   int pstack;
+   long stackArguments;
+   int corruptStack;
+   pmxStackGroup_t *groups; // If set, each group of LWPs is printed rather than each LWP
+   int nGroups;
+   int groupAll;
+   int nItems;           // LWPs or groups to print
+
+   pmxDeferredOutput_t **output; // Buffered output of each item, set once it is complete
+   int next;             // Next item for a worker to pick up
+   int emitted;          // Items written to stdout so far
+   int maxAhead;         // How far workers can get ahead of the output
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+} pmxJobs_t;
+
+static void printLWP(const pmxJobs_t *j, int lwpIndex, int header, int fullStack)
+{
+   mxLWP_t t = j->p->LWPs[lwpIndex];
+
+   if (header)
+      fprintf(getOutputFile(), "**** LWP %d ****\n", t.lwpID);
+
+   snapshotStack(j->p, t);
+
+   if (j->dumpRawStack)
+      dumpStack(j->p, t, j->dumpRawStack);
+
+   if (j->printStack)
+      printCallStack(j->p, t, fullStack, j->stackArguments, j->corruptStack);
+
+   releaseStackSnapshot();
+}
+
+static void printStackGroup(const pmxJobs_t *j, const pmxStackGroup_t *g)
+{
+   FILE *out = getOutputFile();
+
+   fprintf(out, "**** %d LWP%s:", g->nLWPs, g->nLWPs > 1 ? "s" : "");
+   for (int i = 0; i < g->nLWPs; i++)
+      fprintf(out, " %d", j->p->LWPs[g->lwps[i]].lwpID);
+   fprintf(out, " ****\n");
+
+   printLWP(j, g->lwps[0], 0, j->pstack);
+
+   // The other LWPs only differ by their arguments, so only extract those when asked to
+   if (j->groupAll)
+   {
+      for (int i = 1; i < g->nLWPs; i++)
+         printLWP(j, g->lwps[i], 1, 0);
+   }
+}
+
+static void printItem(const pmxJobs_t *j, int i)
+{
+   if (j->groups)
+      printStackGroup(j, j->groups + i);
+   else
+      printLWP(j, j->lwps[i], j->allThreads, j->pstack);
+}
+
+static unsigned int hashFrames(const Elf_Addr *frames, int nFrames)
+{
+   // FNV-1a over the return addresses
+   unsigned int h = 2166136261u;
+   const unsigned char *c = reinterpret_cast<const unsigned char *>(frames);
+   for (size_t i = 0; i < nFrames * sizeof(Elf_Addr); i++)
+   {
+      h ^= c[i];
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static int groupcompare(const void *a, const void *b)
+{
+   // Most common stacks first, otherwise in the order of their first LWP
+   const pmxStackGroup_t *ga = static_cast<const pmxStackGroup_t *>(a);
+   const pmxStackGroup_t *gb = static_cast<const pmxStackGroup_t *>(b);
+   if (ga->nLWPs != gb->nLWPs)
+      return gb->nLWPs - ga->nLWPs;
+   return ga->lwps[0] - gb->lwps[0];
+}
+
+static void groupStacks(pmxJobs_t *j)
+{
+   // Walk every LWP without printing anything, and group those whose stacks have the same return addresses
+   Elf_Addr *frames = static_cast<Elf_Addr *>(malloc(MAX_GROUPED_FRAMES * sizeof(Elf_Addr)));
+   pmxStackGroup_t *groups = static_cast<pmxStackGroup_t *>(calloc(j->nLWPs, sizeof(pmxStackGroup_t)));
+   int *groupID = static_cast<int *>(malloc(j->nLWPs * sizeof(int)));
+   int nGroups = 0;
+
+   unsigned int nEntries = 64;
+   while (nEntries < 2 * (unsigned int) j->nLWPs)
+      nEntries *= 2;
+   unsigned int mask = nEntries - 1;
+   int *table = static_cast<int *>(malloc(nEntries * sizeof(int)));
+   memset(table, -1, nEntries * sizeof(int));
+
+   for (int i = 0; i < j->nLWPs; i++)
+   {
+      mxLWP_t t = j->p->LWPs[j->lwps[i]];
+
+      snapshotStack(j->p, t);
+      int nFrames = getCallStack(j->p, t, j->corruptStack, frames, MAX_GROUPED_FRAMES);
+      releaseStackSnapshot();
+
+      unsigned int hash = hashFrames(frames, nFrames);
+      unsigned int slot = hash & mask;
+      while (table[slot] >= 0)
+      {
+         const pmxStackGroup_t *g = groups + table[slot];
+         if (g->hash == hash && g->nFrames == nFrames && !memcmp(g->frames, frames, nFrames * sizeof(Elf_Addr)))
+            break;
+         slot = (slot + 1) & mask;
+      }
+
+      if (table[slot] < 0)
+      {
+         pmxStackGroup_t *g = groups + nGroups;
+         g->hash = hash;
+         g->nFrames = nFrames;
+         g->frames = static_cast<Elf_Addr *>(malloc(nFrames * sizeof(Elf_Addr)));
+         memcpy(g->frames, frames, nFrames * sizeof(Elf_Addr));
+         table[slot] = nGroups++;
+      }
+
+      groupID[i] = table[slot];
+      groups[groupID[i]].nLWPs++;
+   }
+
+   for (int g = 0; g < nGroups; g++)
+   {
+      groups[g].lwps = static_cast<int *>(malloc(groups[g].nLWPs * sizeof(int)));
+      groups[g].nLWPs = 0;
+   }
+
+   for (int i = 0; i < j->nLWPs; i++)
+   {
+      pmxStackGroup_t *g = groups + groupID[i];
+      g->lwps[g->nLWPs++] = j->lwps[i];
+   }
+
+   qsort(groups, nGroups, sizeof(pmxStackGroup_t), groupcompare);
+   debug("Grouped %d LWPs into %d distinct stacks", j->nLWPs, nGroups);
+
+   free(table);
+   free(groupID);
+   free(frames);
+
+   j->groups = groups;
+   j->nGroups = nGroups;
+}
+
+static void freeStackGroups(pmxJobs_t *j)
+{
+   for (int g = 0; g < j->nGroups; g++)
+   {
+      free(j->groups[g].frames);
+      free(j->groups[g].lwps);
+   }
+   free(j->groups);
+   j->groups = NULL;
+   j->nGroups = 0;
+}
+
+static void addSample(pmxSamples_t *s, const Elf_Addr *frames, int nFrames)
+{
+   if (s->nStacks == s->maxStacks)
+   {
+      s->maxStacks = s->maxStacks ? 2 * s->maxStacks : 64;
+      s->stacks = static_cast<pmxSampledStack_t *>(realloc(s->stacks, s->maxStacks * sizeof(pmxSampledStack_t)));
+
+      free(s->table);
+      s->mask = 2 * s->maxStacks - 1;
+      s->table = static_cast<int *>(malloc(2 * s->maxStacks * sizeof(int)));
+      memset(s->table, -1, 2 * s->maxStacks * sizeof(int));
+      for (int i = 0; i < s->nStacks; i++)
+      {
+         unsigned int slot = s->stacks[i].hash & s->mask;
+         while (s->table[slot] >= 0)
+            slot = (slot + 1) & s->mask;
+         s->table[slot] = i;
+      }
+   }
+
+   unsigned int hash = hashFrames(frames, nFrames);
+   unsigned int slot = hash & s->mask;
+   while (s->table[slot] >= 0)
+   {
+      const pmxSampledStack_t *st = s->stacks + s->table[slot];
+      if (st->hash == hash && st->nFrames == nFrames && !memcmp(st->frames, frames, nFrames * sizeof(Elf_Addr)))
+         break;
+      slot = (slot + 1) & s->mask;
+   }
+
+   if (s->table[slot] < 0)
+   {
+      pmxSampledStack_t *st = s->stacks + s->nStacks;
+      st->hash = hash;
+      st->nFrames = nFrames;
+      st->frames = static_cast<Elf_Addr *>(malloc(nFrames * sizeof(Elf_Addr)));
+      memcpy(st->frames, frames, nFrames * sizeof(Elf_Addr));
+      st->count = 0;
+      s->table[slot] = s->nStacks++;
+   }
+
+   s->stacks[s->table[slot]].count++;
+   s->nSamples++;
+}
+
+static void addLWPSample(const mxProc *p, mxLWP_t t, void *arg)
+{
+   pmxSamples_t *s = static_cast<pmxSamples_t *>(arg);
+   int nFrames = getCallStack(p, t, s->corruptStack, s->frames, MAX_GROUPED_FRAMES);
+   addSample(s, s->frames, nFrames);
+}
+
+static long sampleStacks(mxProc *p, pmxSamples_t *s, int lwp, int nSamples, long interval, mxAttachMode attachMode, int stopped)
+{
+   // Returns the number of samples taken
+   // If stopped, openPID() has stopped the process for the first sample.  Otherwise, and for the other samples, it
+   // is stopped again, which re-reads the LWPs and their registers, while the binary, libraries and symbol indexes
+   // stay loaded.  Only the selected LWPs are listed in p->LWPs.
+   struct timeval start, now;
+   gettimeofday(&start, NULL);
+
+   for (int n = 0; n < nSamples; n++)
+   {
+      if (n || !stopped)
+      {
+         if (n)
+            usleep(interval * 1000);
+         stopMxProcPID(p, lwp);
+         if (attachMode == mxAttachSnapshot)
+         {
+            captureMemorySnapshot(p);
+            detachMxProcPID(p);
+         }
+      }
+
+      for (int i = 0; i < p->nLWPs; i++)
+      {
+         snapshotStack(p, p->LWPs[i]);
+         addLWPSample(p, p->LWPs[i], s);
+         releaseStackSnapshot();
+      }
+
+      detachMxProcPID(p);
+   }
+
+   gettimeofday(&now, NULL);
+   debug("Took %d samples, %d distinct stacks, in %ld ms", nSamples, s->nStacks,
+         (long) ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000));
+   return nSamples;
+}
+
+static int foldedcompare(const void *a, const void *b)
+{
+   return strcmp(static_cast<const pmxFoldedStack_t *>(a)->line, static_cast<const pmxFoldedStack_t *>(b)->line);
+}
+
+static int namecompare(const void *a, const void *b)
+{
+   return strcmp(static_cast<const pmxFunctionCount_t *>(a)->name, static_cast<const pmxFunctionCount_t *>(b)->name);
+}
+
+static int countcompare(const void *a, const void *b)
+{
+   // Most samples first
+   const pmxFunctionCount_t *fa = static_cast<const pmxFunctionCount_t *>(a);
+   const pmxFunctionCount_t *fb = static_cast<const pmxFunctionCount_t *>(b);
+   if (fa->self != fb->self)
+      return fa->self < fb->self ? 1 : -1;
+   if (fa->total != fb->total)
+      return fa->total < fb->total ? 1 : -1;
+   return strcmp(fa->name, fb->name);
+}
+
+static void printFoldedStacks(const mxProc *p, const pmxSamples_t *s, FILE *out)
+{
+   // One "outermost;...;innermost count" line per distinct list of functions, as read by flamegraph.pl.
+   // Stacks that only differ by their return addresses within the same functions are merged.
+   pmxFoldedStack_t *folded = static_cast<pmxFoldedStack_t *>(malloc(s->nStacks * sizeof(pmxFoldedStack_t)));
+   const char **names = static_cast<const char **>(malloc(MAX_GROUPED_FRAMES * sizeof(char *)));
+   int nFolded = 0;
+
+   for (int i = 0; i < s->nStacks; i++)
+   {
+      const pmxSampledStack_t *st = s->stacks + i;
+      if (!st->nFrames)
+         continue;
+
+      size_t length = 0;
+      for (int k = 0; k < st->nFrames; k++)
+      {
+         names[k] = getFunctionName(p, st->frames[k]);
+         length += strlen(names[k]) + 1;
+      }
+
+      char *c = static_cast<char *>(malloc(length));
+      folded[nFolded].line = c;
+      folded[nFolded++].count = st->count;
+
+      for (int k = st->nFrames - 1; k >= 0; k--)
+      {
+         size_t n = strlen(names[k]);
+         memcpy(c, names[k], n);
+         c += n;
+         *c++ = k ? ';' : '\0';
+      }
+   }
+
+   qsort(folded, nFolded, sizeof(pmxFoldedStack_t), foldedcompare);
+
+   for (int i = 0; i < nFolded; i++)
+   {
+      long count = folded[i].count;
+      while (i + 1 < nFolded && !strcmp(folded[i].line, folded[i + 1].line))
+      {
+         free(folded[i].line);
+         count += folded[++i].count;
+      }
+      fprintf(out, "%s %ld\n", folded[i].line, count);
+      free(folded[i].line);
+   }
+
+   free(names);
+   free(folded);
+}
+
+static void printFunctionHistogram(const mxProc *p, const pmxSamples_t *s, FILE *out)
+{
+   // Each function is counted once per stack it appears in, however deep it recurses
+   int nCounts = 0;
+   int maxCounts = 1024;
+   pmxFunctionCount_t *counts = static_cast<pmxFunctionCount_t *>(malloc(maxCounts * sizeof(pmxFunctionCount_t)));
+
+   for (int i = 0; i < s->nStacks; i++)
+   {
+      const pmxSampledStack_t *st = s->stacks + i;
+      int first = nCounts;
+
+      for (int k = 0; k < st->nFrames; k++)
+      {
+         const char *name = getFunctionName(p, st->frames[k]);
+         int seen = 0;
+         for (int m = first; m < nCounts && !seen; m++)
+            seen = !strcmp(counts[m].name, name);
+         if (seen)
+            continue;
+
+         if (nCounts == maxCounts)
+         {
+            maxCounts *= 2;
+            counts = static_cast<pmxFunctionCount_t *>(realloc(counts, maxCounts * sizeof(pmxFunctionCount_t)));
+         }
+         counts[nCounts].name = name;
+         counts[nCounts].self = k ? 0 : st->count;
+         counts[nCounts++].total = st->count;
+      }
+   }
+
+   // Merge the counts of each function, then sort them by samples
+   qsort(counts, nCounts, sizeof(pmxFunctionCount_t), namecompare);
+   int nFunctions = 0;
+   for (int i = 0; i < nCounts; i++)
+   {
+      if (nFunctions && !strcmp(counts[nFunctions - 1].name, counts[i].name))
+      {
+         counts[nFunctions - 1].self += counts[i].self;
+         counts[nFunctions - 1].total += counts[i].total;
+      }
+      else
+         counts[nFunctions++] = counts[i];
+   }
+   qsort(counts, nFunctions, sizeof(pmxFunctionCount_t), countcompare);
+
+   fprintf(out, "%6s %8s %6s %8s  %s\n", "Self%", "Self", "Total%", "Total", "Function");
+   for (int i = 0; i < nFunctions; i++)
+   {
+      fprintf(out, "%5.1f%% %8ld %5.1f%% %8ld  %s\n", 100.0 * counts[i].self / s->nSamples, counts[i].self,
+              100.0 * counts[i].total / s->nSamples, counts[i].total, counts[i].name);
+   }
+
+   free(counts);
+}
+
+static void printSamples(const mxProc *p, const pmxSamples_t *s, long nTaken)
+{
+   // With --perf, LWPs are sampled separately so there are as many samples taken as stacks
+   printf("**** %ld samples, %ld stacks, %d distinct ****\n", nTaken, s->nSamples, s->nStacks);
+   if (!s->nSamples)
+      return;
+
+   if (getInlineMode())
+   {
+      printFoldedStacks(p, s, stdout);
+      printf("\n");
+   }
+   else
+   {
+      char fileName[sizeof(p->filePrefix) + 8];
+      snprintf(fileName, sizeof(fileName), "%s.folded", p->filePrefix);
+#if defined(__sun) && !defined (_LP64)
+      FILE *fp = fopen(fileName, "wF");
+#else
+      FILE *fp = fopen(fileName, "w");
+#endif
+      if (!fp)
+         warning("Failed to open %s for output. Maybe you need to add -p to the command line.", fileName);
+      else
+      {
+         printFoldedStacks(p, s, fp);
+         fclose(fp);
+         printf("Folded stacks written to %s\n", fileName);
+      }
+   }
+
+   printFunctionHistogram(p, s, stdout);
+}
+
+static void freeSamples(pmxSamples_t *s)
+{
+   for (int i = 0; i < s->nStacks; i++)
+      free(s->stacks[i].frames);
+   free(s->stacks);
+   free(s->table);
+   memset(s, 0, sizeof(pmxSamples_t));
+}
+
+static void *unwindLWPs(void *arg)
+{
+   pmxJobs_t *j = static_cast<pmxJobs_t *>(arg);
+
+   pthread_mutex_lock(&j->mutex);
+   while (j->next < j->nItems)
+   {
+      // Don't run too far ahead of the output, so that only a few LWPs are buffered at a time
+      if (j->next >= j->emitted + j->maxAhead)
+      {
+         pthread_cond_wait(&j->cond, &j->mutex);
+         continue;
+      }
+
+      int i = j->next++;
+      pthread_mutex_unlock(&j->mutex);
+
+      FILE *fp = tmpfile();
+      if (!fp)
+         fatal_error("Unable to create a temporary file for the output of item %d, errno %d", i, errno);
+
+      startDeferredOutput(fp);
+      printItem(j, i);
+      pmxDeferredOutput_t *output = finishDeferredOutput();
+
+      pthread_mutex_lock(&j->mutex);
+      j->output[i] = output;
+      pthread_cond_broadcast(&j->cond);
+   }
+   pthread_mutex_unlock(&j->mutex);
+
+   freePrintState();
+   return NULL;
+}
+
+static void printLWPsInParallel(pmxJobs_t *j, int nJobs)
+{
+   // Each worker unwinds whole LWPs into a temporary file, which are written to stdout in the original order
+   if (nJobs > j->nItems)
+      nJobs = j->nItems;
+
+   j->output = static_cast<pmxDeferredOutput_t **>(calloc(j->nItems, sizeof(pmxDeferredOutput_t *)));
+   j->next = 0;
+   j->emitted = 0;
+   j->maxAhead = 4 * nJobs;
+   pthread_mutex_init(&j->mutex, NULL);
+   pthread_cond_init(&j->cond, NULL);
+
+   pthread_t *workers = static_cast<pthread_t *>(malloc(nJobs * sizeof(pthread_t)));
+   for (int i = 0; i < nJobs; i++)
+   {
+      if (pthread_create(workers + i, NULL, unwindLWPs, j))
+         fatal_error("Unable to start thread %d of %d", i + 1, nJobs);
+   }
+
+   for (int i = 0; i < j->nItems; i++)
+   {
+      pthread_mutex_lock(&j->mutex);
+      while (!j->output[i])
+         pthread_cond_wait(&j->cond, &j->mutex);
+      pmxDeferredOutput_t *output = j->output[i];
+      pthread_mutex_unlock(&j->mutex);
+
+      emitDeferredOutput(j->p, output, stdout);
+
+      pthread_mutex_lock(&j->mutex);
+      j->output[i] = NULL;
+      j->emitted++;
+      pthread_cond_broadcast(&j->cond);
+      pthread_mutex_unlock(&j->mutex);
+   }
+
+   for (int i = 0; i < nJobs; i++)
+      pthread_join(workers[i], NULL);
+
+   free(workers);
+   free(j->output);
+   j->output = NULL;
+   pthread_cond_destroy(&j->cond);
+   pthread_mutex_destroy(&j->mutex);
+}
+
 int main(int argc, char *argv[])
 {
    //These are the different modes we can run in
@@ -46,6 +619,12 @@ int main(int argc, char *argv[])
    int corruptStack=200;
    int force=0;
    int print_types = 0;
+   int nJobs = 1;
+   int groupStackMode = 0;
+   int nSamples = 0;
+   long sampleInterval = 100;
+   mxAttachMode attachMode = mxAttachStop;
+   int sampleOnly = 0;
 
    if ((command = strrchr(argv[0], '/')) != NULL)
    {
@@ -89,26 +668,44 @@ int main(int argc, char *argv[])
    char sz_address[]="address";
    char sz_force[]="force";
    char sz_remap[]="remap";
+   char sz_jobs[]="jobs";
+   char sz_group_stacks[]="group-stacks";
+   char sz_snapshot[]="snapshot";
+   char sz_snapshot_range[]="snapshot-range";
+   char sz_sample[]="sample";
+   char sz_interval[]="interval";
+   char sz_perf[]="perf";
+   char sz_passive[]="passive";
+   char sz_cache[]="cache";
 
    static struct option long_options[] = {
       {sz_args,         required_argument, 0, 'a' },
       {sz_pldd,         no_argument,       0, 'b' },
       {sz_pmap,         no_argument,       0, 'c' },
+      {sz_cache,        required_argument, 0, 'C' },
       {sz_type,         required_argument, 0, 'd' },
       {sz_all,          no_argument,       0, 'e' },
       {sz_all_threads,  no_argument,       0, 'f' },
       {sz_extract,      no_argument,       0, 'g' },
+      {sz_group_stacks, optional_argument, 0, 'G' },
       {sz_help,         no_argument,       0, 'h' },
       {sz_inline,       no_argument,       0, 'i' },
+      {sz_interval,     required_argument, 0, 'I' },
       {sz_corrupt,      required_argument, 0, 'j' },
+      {sz_jobs,         required_argument, 0, 'J' },
       {sz_force,        no_argument,       0, 'k' },
       {sz_sysroot,      required_argument, 0, 'l' },
       {sz_libext,       required_argument, 0, 'L' },
       {sz_pargs,        no_argument,       0, 'm' },
+      {sz_perf,         no_argument,       0, 'P' },
       {sz_remap,        required_argument, 0, 'M' },
+      {sz_sample,       required_argument, 0, 'n' },
+      {sz_passive,      no_argument,       0, 'N' },
       {sz_output_prefix,required_argument, 0, 'p' },
       {sz_raw_stack,    required_argument, 0, 'r' },
+      {sz_snapshot_range, required_argument, 0, 'R' },
       {sz_pstack,       no_argument,       0, 's' },
+      {sz_snapshot,     no_argument,       0, 'S' },
       {sz_show_types,   no_argument,       0, 't' },
       {sz_verbose,      no_argument,       0, 'v' },
       {sz_address,      required_argument, 0, 'x' },
@@ -117,7 +714,7 @@ int main(int argc, char *argv[])
 
    /* options */
    int opt_index=0;
-   while ((opt = getopt_long(argc, argv, "a:bcd:efhij:l:L:mM:p:r:stvx:", long_options, &opt_index)) != -1)
+   while ((opt = getopt_long(argc, argv, "a:bcC:d:efG::hiI:j:J:l:L:mM:n:Np:Pr:R:sStvx:", long_options, &opt_index)) != -1)
    {
       switch (opt)
       {
@@ -130,6 +727,16 @@ int main(int argc, char *argv[])
          case 'c':
             pmap = 1;
             break;
+         case 'C':
+            {
+               char *end = NULL;
+               long blocks = strtol(optarg, &end, 10);
+               if (end == optarg || *end)
+                  errflg = 1;
+               else
+                  setPageCacheSize(blocks);
+            }
+            break;
          case 'd':
             strncpy(dataType,optarg,sizeof(dataType));
             break;
@@ -142,15 +749,32 @@ int main(int argc, char *argv[])
          case 'g':
             extract = 1;
             break;
+         case 'G':
+            groupStackMode = 1;
+            if (optarg && !strcmp(optarg, "all"))
+               groupStackMode = 2;
+            else if (optarg)
+               errflg = 1;
+            break;
          case 'h':
             errflg = 1;
             break;
          case 'i':
             setInlineMode(1);
             break;
+         case 'I':
+            sampleInterval=strtol(optarg,NULL,10);
+            if (sampleInterval < 0)
+               sampleInterval = 0;
+            break;
          case 'j':
             corruptStack=strtol(optarg,NULL,10);
             break;
+         case 'J':
+            nJobs=strtol(optarg,NULL,10);
+            if (nJobs < 1)
+               nJobs = 1;
+            break;
          case 'k':
             force = 1;
             break;
@@ -168,15 +792,40 @@ int main(int argc, char *argv[])
          case 'M': // remap expects two arguments, the source and destination
             add_remap_entry(optarg, (char *)" ");
             break;
+         case 'n':
+            nSamples=strtol(optarg,NULL,10);
+            if (nSamples < 1)
+               errflg = 1;
+            break;
+         case 'N':
+            attachMode = mxAttachPassive;
+            break;
          case 'p':
             strncpy(filePrefix,optarg,sizeof(filePrefix));
             break;
+         case 'P':
+            attachMode = mxAttachNone;
+            break;
          case 'r':
             dumpRawStack = strtol(optarg,NULL,0);
             break;
+         case 'R':
+            {
+               char *size = NULL;
+               Elf_Addr start = (Elf_Addr) strtoul(optarg, &size, 0);
+               if (*size != ',')
+                  errflg = 1;
+               else
+                  addSnapshotRange(start, strtoul(size + 1, NULL, 0));
+            }
+            attachMode = mxAttachSnapshot;
+            break;
          case 's':
             pstack = 1; extract=1;
             break;
+         case 'S':
+            attachMode = mxAttachSnapshot;
+            break;
          case 't':
             print_types = 1;
             break;
@@ -220,6 +869,9 @@ int main(int argc, char *argv[])
       fprintf(stderr, "  --pmap, -c               Print memory map of process.\n");
       fprintf(stderr, "  --show-types, -t         Print supported data types.\n");
       fprintf(stderr, "  --raw-stack=n, -r n      Print n words from of the raw stack.\n");
+      fprintf(stderr, "  --sample=n, -n n         Sample the stacks of a live process n times and print\n");
+      fprintf(stderr, "                           how often each function was seen.  The stacks are\n");
+      fprintf(stderr, "                           written to prefix.folded, for flame graphs.\n");
       fprintf(stderr, "  --address=addr, -x addr  Print data structure at addr.  Use with --type.\n");
       fprintf(stderr, "                           addr can be a hex address (0x1234) or a symbol.\n");
       fprintf(stderr, "\n");
@@ -240,12 +892,36 @@ int main(int argc, char *argv[])
       fprintf(stderr, "                           If unspecified, the core file name is used.\n");
       fprintf(stderr, "  --corrupt-stack=n, -j n  Search this many words for a valid frame in the case\n");
       fprintf(stderr, "                           of stack corruption.  Default 200.\n");
+      fprintf(stderr, "  --group-stacks[=all], -G Print threads with the same stack once, with their LWPs.\n");
+      fprintf(stderr, "                           Arguments are only extracted for the first thread of\n");
+      fprintf(stderr, "                           each stack, unless =all is given.\n");
+      fprintf(stderr, "  --jobs=n, -J n           Unwind n threads at a time.  Use with --all-threads.\n");
+      fprintf(stderr, "                           The output is the same as with one job, except for\n");
+      fprintf(stderr, "                           anything -L extensions print to stdout directly.\n");
+      fprintf(stderr, "                           Ignored if memory can only be read with ptrace.\n");
+      fprintf(stderr, "                           Default 1.\n");
+      fprintf(stderr, "  --snapshot, -S           Copy the stacks of a live process and let it run again\n");
+      fprintf(stderr, "                           before analysing them.  Other memory is read from the\n");
+      fprintf(stderr, "                           running process.\n");
+      fprintf(stderr, "  --snapshot-range=addr,size, -R addr,size\n");
+      fprintf(stderr, "                           Also copy size bytes at addr.  Implies --snapshot.\n");
+      fprintf(stderr, "  --passive, -N            Copy the stacks of threads blocked in the kernel\n");
+      fprintf(stderr, "                           without stopping them.  Running threads are stopped\n");
+      fprintf(stderr, "                           just long enough to copy their stacks.\n");
+      fprintf(stderr, "  --cache=n, -C n          Cache up to n 4kB blocks of memory read from a live\n");
+      fprintf(stderr, "                           process, at most 1048576.  0 disables the cache.\n");
+      fprintf(stderr, "                           Default 2048.\n");
+      fprintf(stderr, "  --interval=ms, -I ms     Let the process run for ms between samples.\n");
+      fprintf(stderr, "                           Use with --sample.  Default 100.\n");
+      fprintf(stderr, "  --perf, -P               Sample with perf events rather than stopping the\n");
+      fprintf(stderr, "                           process.  Threads are sampled every ms they run, for\n");
+      fprintf(stderr, "                           n times ms.  Use with --sample.  Linux only.\n");
       fprintf(stderr, "  --verbose, -v            Print pmx debugging/troubleshooing information.\n");
       exit(2);
    }
 
    // If no other modes are specified, default to extract mode
-   if (!pldd && !pmap && !pargs && !address && !dumpRawStack )
+   if (!pldd && !pmap && !pargs && !address && !dumpRawStack && !nSamples)
       extract=1;
 
    int statResult = 0;
@@ -256,6 +932,18 @@ int main(int argc, char *argv[])
       libextHandle = dlopen(libraryExtension, RTLD_LAZY);
       if(!libextHandle)
          warning("Unable to open the extension library!\n");
+      else
+      {
+         // Built against other structures, it would misread them
+         const int *abi = (const int *)dlsym(libextHandle, "pmx_extension_abi");
+         if (!abi || *abi != PMX_EXTENSION_ABI)
+         {
+            warning("%s was built for version %d of the extension ABI rather than %d.  Rebuild it against this pmx.  It is not loaded.",
+                    libraryExtension, abi ? *abi : 1, PMX_EXTENSION_ABI);
+            dlclose(libextHandle);
+            libextHandle = NULL;
+         }
+      }
    }
 
    TypePrinterEntry *ext = NULL;
@@ -337,6 +1025,13 @@ int main(int argc, char *argv[])
       }
    }
 
+   if (nSamples && isCoreFile)
+      fatal_error("--sample only works with a live process");
+   if (attachMode == mxAttachNone && (!nSamples || isCoreFile))
+      fatal_error("--perf needs --sample and a live process");
+   if (attachMode == mxAttachNone && sampleInterval < 1)
+      fatal_error("--perf needs an --interval of at least 1 ms");
+
    // Open Process/Core.  This covers pldd functionality
    if (isCoreFile)
    {
@@ -354,8 +1049,11 @@ int main(int argc, char *argv[])
    }
    else
    {
+      // When only sampling, the first sample stops the process once everything is loaded, like the others
+      sampleOnly = nSamples && !pstack && !pargs && !extract && !dumpRawStack &&
+                   (attachMode == mxAttachStop || attachMode == mxAttachSnapshot);
       debug("opening live process %s", processBase);
-      p = openPID(mx, processBase, pldd);
+      p = openPID(mx, processBase, pldd, sampleOnly ? mxAttachNone : attachMode, lwp);
    }
 
    // Check that pmx, binary and core/PID are consistent as it may lead to bad structures / symbols
@@ -418,24 +1116,77 @@ int main(int argc, char *argv[])
          pargs_fallback=1;
    }
 
-   if (pstack || pargs_fallback || extract || dumpRawStack )
+   // Without stopping the process, its registers aren't known
+   if ((pstack || pargs_fallback || extract || dumpRawStack) && attachMode == mxAttachNone)
+      warning("Stacks can only be printed with --perf through --sample");
+   else if (pstack || pargs_fallback || extract || dumpRawStack )
    {
+      pmxJobs_t jobs;
+      memset(&jobs, 0, sizeof(jobs));
+      jobs.p = p;
+      jobs.lwps = static_cast<int *>(malloc(p->nLWPs * sizeof(int)));
+      jobs.allThreads = !lwp;
+      jobs.dumpRawStack = dumpRawStack;
+      jobs.printStack = pstack || pargs_fallback || extract;
+      jobs.pstack = pstack;
+      jobs.stackArguments = stackArguments;
+      jobs.corruptStack = corruptStack;
+
       for (int i = 0; i < p->nLWPs; i++)
       {
          if (!lwp                  // All threads
              || lwp == p->LWPs[i].lwpID    // Selected Thread
              || (lwp == 1 && p->pid == p->LWPs[i].lwpID))  // Special hack for linux to allow use of /1
          {
-            if (!lwp)
-               printf("**** LWP %d ****\n", p->LWPs[i].lwpID);
+            jobs.lwps[jobs.nLWPs++] = i;
+         }
+      }
 
-            if (dumpRawStack)
-               dumpStack(p, p->LWPs[i], dumpRawStack);
+      if (groupStackMode)
+      {
+         jobs.groupAll = groupStackMode > 1;
+         groupStacks(&jobs);
+      }
+      jobs.nItems = jobs.groups ? jobs.nGroups : jobs.nLWPs;
 
-            if (pstack || pargs_fallback || extract)
-               printCallStack(p, p->LWPs[i], pstack, stackArguments, corruptStack);
-         }
+      if (nJobs > 1 && !canReadFromAnyThread(p))
+      {
+         warning("Memory of process %d can only be read with ptrace, so --jobs is ignored", p->pid);
+         nJobs = 1;
+      }
+
+      if (nJobs > 1 && jobs.nItems > 1)
+      {
+         debug("Unwinding %d LWPs with %d jobs", jobs.nLWPs, nJobs);
+         printLWPsInParallel(&jobs, nJobs);
+      }
+      else
+      {
+         for (int i = 0; i < jobs.nItems; i++)
+            printItem(&jobs, i);
       }
+
+      freeStackGroups(&jobs);
+      free(jobs.lwps);
+      freePrintState();
+   }
+
+   if (nSamples)
+   {
+      pmxSamples_t samples;
+      memset(&samples, 0, sizeof(samples));
+      samples.corruptStack = corruptStack;
+      samples.frames = static_cast<Elf_Addr *>(malloc(MAX_GROUPED_FRAMES * sizeof(Elf_Addr)));
+
+      long nTaken;
+      if (attachMode != mxAttachNone)
+         nTaken = sampleStacks(p, &samples, lwp, nSamples, sampleInterval, attachMode, !sampleOnly);
+      else if ((nTaken = samplePerfEvents(p, sampleInterval, nSamples * sampleInterval, addLWPSample, &samples)) < 0)
+         fatal_error("Unable to open perf events for process %d.  Check /proc/sys/kernel/perf_event_paranoid", p->pid);
+
+      printSamples(p, &samples, nTaken);
+      free(samples.frames);
+      freeSamples(&samples);
    }
 
    // Close proc to free memory, file descriptors, etc
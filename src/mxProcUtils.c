@@ -21,6 +21,8 @@
 #include <time.h>
 #include <link.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "mxProcUtils.h"
 #include "pmx.h"
@@ -37,10 +39,48 @@
 
 static const char *unknownSymbol = "??????";
 
+// See readCachedVM()
+static int pageCacheBlocks = DEFAULT_PAGE_CACHE_BLOCKS;
+static unsigned long pageCacheGeneration = 0;
+
 void initMxProc(mxProc * p)
 {
    memset(p, 0, sizeof(mxProc));
    p->type = mxProcTypeNone;
+   p->windows = static_cast<mxFileWindows_t *>(calloc(1, sizeof(mxFileWindows_t)));
+   p->nameIndex = static_cast<mxNameIndex_t *>(calloc(1, sizeof(mxNameIndex_t)));
+   p->demangleCache = static_cast<mxDemangleCache_t *>(calloc(1, sizeof(mxDemangleCache_t)));
+   p->prologueCache = static_cast<mxPrologueCache_t *>(calloc(1, sizeof(mxPrologueCache_t)));
+   p->pageCache = static_cast<mxPageCache_t *>(calloc(1, sizeof(mxPageCache_t)));
+   p->pageCache->maxBlocks = pageCacheBlocks;
+   p->pageCache->generation = ++pageCacheGeneration;
+}
+
+void *growArray(void *array, int *maxItems, size_t itemSize, int nItems)
+{
+   // Makes room for nItems in array, doubling its size as needed.  New items are zeroed.
+   int oldMax = *maxItems;
+   int newMax = oldMax ? oldMax : 16;
+   while (newMax < nItems)
+      newMax *= 2;
+   if (newMax == oldMax)
+      return array;
+
+   array = realloc(array, newMax * itemSize);
+   if (!array)
+      fatal_error("Out of memory growing an array to %d items", newMax);
+   memset(static_cast<char *>(array) + oldMax * itemSize, 0, (newMax - oldMax) * itemSize);
+   *maxItems = newMax;
+   return array;
+}
+
+mxLWP_t *addLWP(mxProc *p)
+{
+   // Returns a cleared entry at the end of p->LWPs
+   p->LWPs = static_cast<mxLWP_t *>(growArray(p->LWPs, &p->maxLWPs, sizeof(mxLWP_t), p->nLWPs + 1));
+   mxLWP_t *lwp = p->LWPs + p->nLWPs++;
+   memset(lwp, 0, sizeof(mxLWP_t));
+   return lwp;
 }
 
 static int verbose=0;
@@ -52,6 +92,23 @@ void setVerbose(int v)
    verbose=1;
 }
 
+// Each thread can send its output somewhere other than stdout, e.g. to keep LWPs apart with --jobs
+static __thread FILE *outputFile = NULL;
+
+void setOutputFile(FILE *fp)
+{
+   outputFile = fp;
+}
+
+FILE *getOutputFile()
+{
+   return outputFile ? outputFile : stdout;
+}
+
+// Guard the lazily built parts of an mxProc (file windows, name index, demangle and prologue caches)
+static pthread_mutex_t windowMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
 void inline_replace(char *orig, char *pattern, char *replace)
 {
    if(NULL == orig || NULL == pattern || NULL == replace)
@@ -156,9 +213,9 @@ void debug(const char *format, ...)
 
    if (verbose)
    {
-      fprintf(stdout, " [debug] ");
-      vfprintf(stdout, format, ap);
-      fprintf(stdout, "\n");
+      fprintf(getOutputFile(), " [debug] ");
+      vfprintf(getOutputFile(), format, ap);
+      fprintf(getOutputFile(), "\n");
    }
 
    va_end(ap);
@@ -172,9 +229,9 @@ void trace(const char *format, ...)
 
    if (verbose)
    {
-      fprintf(stdout, KBLU " [trace] ");
-      vfprintf(stdout, format, ap);
-      fprintf(stdout, "\n" KNRM);
+      fprintf(getOutputFile(), KBLU " [trace] ");
+      vfprintf(getOutputFile(), format, ap);
+      fprintf(getOutputFile(), "\n" KNRM);
    }
 
    va_end(ap);
@@ -185,9 +242,9 @@ void warning(const char *format, ...)
    va_list ap;
 
    va_start(ap, format);
-   fprintf(stdout, KYEL " Warning: ");
-   vfprintf(stdout, format, ap);
-   fprintf(stdout, "\n" KNRM);
+   fprintf(getOutputFile(), KYEL " Warning: ");
+   vfprintf(getOutputFile(), format, ap);
+   fprintf(getOutputFile(), "\n" KNRM);
    va_end(ap);
 }
 
@@ -246,6 +303,148 @@ void *mmapFile(mxProc * p, const char *fileName, int *fd, size_t * size, mxstat
    return addr;
 }
 
+static const char *getFileWindow(const mxProc *c, int elfID, Elf_Addr fileAddr, size_t *available, mxFileWindow_t **pinned)
+{
+   // Returns a pointer to the mapped data at fileAddr, and how many bytes can be read from it.  Called with windowMutex held.
+   // The window is pinned until the caller releases it with unpinFileWindow(), after which it may be unmapped.
+   mxFileWindows_t *w = c->windows;
+   Elf_Off offset = fileAddr - fileAddr % FILE_WINDOW_SIZE;
+
+   if (fileAddr >= (Elf_Addr) c->elfFile[elfID].stat.st_size)
+      return NULL;
+
+   mxFileWindow_t *window = NULL;
+   for (int i = 0; i < w->nWindows; i++)
+   {
+      if (w->window[i].elfID == elfID && w->window[i].offset == offset)
+      {
+         window = w->window + i;
+         break;
+      }
+   }
+
+   if (!window)
+   {
+      if (w->nWindows < MAX_FILE_WINDOWS)
+      {
+         window = w->window + w->nWindows++;
+      }
+      else
+      {
+         for (int i = 0; i < w->nWindows; i++)
+            if (!w->window[i].refs && (!window || w->window[i].lastUsed < window->lastUsed))
+               window = w->window + i;
+         if (!window)
+            return NULL;  // All in use, so the caller reads the file instead
+         if (window->mmloc)
+            munmap(window->mmloc, window->size);
+      }
+
+      window->elfID = elfID;
+      window->offset = offset;
+      window->size = FILE_WINDOW_SIZE;
+      if (offset + window->size > (Elf_Off) c->elfFile[elfID].stat.st_size)
+         window->size = c->elfFile[elfID].stat.st_size - offset;
+
+#ifdef __sun
+      window->mmloc = static_cast<char *>(mmap64(0, window->size, PROT_READ, MAP_SHARED, c->elfFile[elfID].fd, offset));
+#else
+      window->mmloc = static_cast<char *>(mmap(0, window->size, PROT_READ, MAP_SHARED, c->elfFile[elfID].fd, offset));
+#endif
+      if (window->mmloc == MAP_FAILED)
+      {
+         debug("Unable to map %lu bytes at offset " FMT_ADR " of %s, errno %d", (unsigned long) window->size, (unsigned long) offset, c->elfFile[elfID].fileName, errno);
+         // Leave the slot empty rather than moving other windows, as they may be pinned
+         window->elfID = -1;
+         window->mmloc = NULL;
+         window->size = 0;
+         window->lastUsed = 0;
+         return NULL;
+      }
+   }
+
+   window->lastUsed = ++w->clock;
+   window->refs++;
+   *pinned = window;
+   *available = window->size - (fileAddr - offset);
+   return window->mmloc + (fileAddr - offset);
+}
+
+static void unpinFileWindow(mxFileWindow_t *window)
+{
+   if (window)
+      __sync_fetch_and_sub(&window->refs, 1);
+}
+
+static const char *getFullyMappedData(const mxProc *c, int elfID, Elf_Addr fileAddr, size_t *available)
+{
+   // Files opened in full are already mapped, so no need for a window or for the lock
+   const mxElfFile *f = c->elfFile + elfID;
+   if (f->mmloc && fileAddr < f->mmsize)
+   {
+      *available = f->mmsize - fileAddr;
+      return static_cast<const char *>(f->mmloc) + fileAddr;
+   }
+
+   return NULL;
+}
+
+static const char *getMappedFileData(const mxProc *c, int elfID, Elf_Addr fileAddr, size_t *available, mxFileWindow_t **pinned)
+{
+   // Sets *pinned if the data is in a window, see getFileWindow()
+   *pinned = NULL;
+   const char *data = getFullyMappedData(c, elfID, fileAddr, available);
+   if (data)
+      return data;
+
+   pthread_mutex_lock(&windowMutex);
+   data = getFileWindow(c, elfID, fileAddr, available, pinned);
+   pthread_mutex_unlock(&windowMutex);
+   return data;
+}
+
+int readFileMapped(const mxProc * c, int elfID, Elf_Addr fileAddr, void *buffPointer, size_t size)
+{
+   // Returns 0 if the read was served from mapped memory.  As with read(), nothing past the end of the file is copied.
+   char *buff = static_cast<char *>(buffPointer);
+
+   if (!c->windows)
+      return 1;
+
+   while (size)
+   {
+      size_t available = 0;
+      mxFileWindow_t *window;
+      const char *data = getMappedFileData(c, elfID, fileAddr, &available, &window);
+      if (!data)
+         return fileAddr < (Elf_Addr) c->elfFile[elfID].stat.st_size;
+
+      size_t n = size < available ? size : available;
+      memcpy(buff, data, n);
+      unpinFileWindow(window);
+      buff += n;
+      fileAddr += n;
+      size -= n;
+   }
+
+   return 0;
+}
+
+static void unmapFileWindows(mxProc *p)
+{
+   if (!p->windows)
+      return;
+
+   for (int i = 0; i < p->windows->nWindows; i++)
+   {
+      if (p->windows->window[i].mmloc)
+         munmap(p->windows->window[i].mmloc, p->windows->window[i].size);
+   }
+
+   free(p->windows);
+   p->windows = NULL;
+}
+
 void dumpSymbolTable(mxProc * p, int i)
 {
    const Elf_Sym *symbol = p->symtab[i].table;
@@ -364,10 +563,6 @@ int isValidElf(mxProc *p, const Elf_Ehdr * elfHdr)
 
 void loadSymbols(mxProc * p, int elfID, Elf_Addr baseAddr)
 {
-   // Make sure we don't over run the buffer
-   if (p->nsymtabs >= MAX_SYMTABS)
-      return;
-
    const char * mmFile = reinterpret_cast <const char *>(p->elfFile[elfID].mmloc);
 
    // Read ELF File header and confirm it's an elf file
@@ -397,15 +592,33 @@ void loadSymbols(mxProc * p, int elfID, Elf_Addr baseAddr)
             //printf("Adding symbol table %d from section %d from elfID %d with %d symbols baseAddr " FMT_ADR "\n", p->nsymtabs,  i, elfID, secHdrs[i].sh_size / sizeof(Elf_Sym), baseAddr);
             int stringSection = secHdrs[i].sh_link;
 
+            p->symtab = static_cast<mxSymTab_t *>(growArray(p->symtab, &p->maxSymtabs, sizeof(mxSymTab_t), p->nsymtabs + 1));
             p->symtab[p->nsymtabs].strings = mmFile + secHdrs[stringSection].sh_offset;
             p->symtab[p->nsymtabs].size = secHdrs[i].sh_size;
             p->symtab[p->nsymtabs].table = reinterpret_cast < const Elf_Sym *>(mmFile + secHdrs[i].sh_offset);
 
             p->symtab[p->nsymtabs].baseAddr = baseAddr;
+            p->symtab[p->nsymtabs].elfID = elfID;
+            p->symtab[p->nsymtabs].type = secHdrs[i].sh_type;
+            p->symtab[p->nsymtabs].gnuHash = NULL;
+            p->symtab[p->nsymtabs].sysvHash = NULL;
+
+            // Hash sections for this table allow fast lookups by name
+            for (int j = 0; j < elfHdr->e_shnum; j++)
+            {
+               if (secHdrs[j].sh_link != (Elf_Word) i || secHdrs[j].sh_offset + secHdrs[j].sh_size > p->elfFile[elfID].mmsize)
+                  continue;
+
+               const Elf_Word *hash = reinterpret_cast < const Elf_Word *>(mmFile + secHdrs[j].sh_offset);
+#ifdef SHT_GNU_HASH
+               if (secHdrs[j].sh_type == SHT_GNU_HASH)
+                  p->symtab[p->nsymtabs].gnuHash = hash;
+#endif
+               if (secHdrs[j].sh_type == SHT_HASH)
+                  p->symtab[p->nsymtabs].sysvHash = hash;
+            }
             //dumpSymbolTable(p,p->nsymtabs);
             p->nsymtabs++;
-            if (p->nsymtabs >= MAX_SYMTABS)
-               break;
          }
       }
       else {
@@ -603,6 +816,7 @@ void printpmap(mxProc *c)
 
 int openElfFile(mxProc *c,  const char *fileName, Elf_Addr baseAddr, int justHeaders, int failIfInvalid)
 {
+   c->elfFile = static_cast<mxElfFile *>(growArray(c->elfFile, &c->maxElfFiles, sizeof(mxElfFile), c->elfOpen + 1));
    int intFD = c->elfOpen++;
 
    // We can't mmap the whole thing as it won't fit in our address space for large files in 32bit.
@@ -704,11 +918,13 @@ mxProc *openCoreFile(const char *binFileName, const char *coreFileName, const ch
    loadSymbols(c, binFileID, 0);
    checkCoreSize(c,0);
    loadLibraries(c, binFileID, libraryRoot, plddMode);
+   buildSegmentIndex(c);
+   buildSymbolIndex(c);
 
    return c;
 }
 
-void getFileAddrFromCore(const mxProc *c, Elf_Addr vmAddr, Elf_Addr *fileAddr, int *elfFile, int so)
+static void getFileAddrFromCoreLinear(const mxProc *c, Elf_Addr vmAddr, Elf_Addr *fileAddr, int *elfFile, int so)
 {
    *fileAddr=0;
 
@@ -768,106 +984,1658 @@ void getFileAddrFromCore(const mxProc *c, Elf_Addr vmAddr, Elf_Addr *fileAddr, i
    }
 }
 
-static const char *searchSymbolTable(const mxSymTab_t * t, Elf_Addr vmAddr, Elf_Off * offset)
+typedef struct
 {
-   const Elf_Sym *symbol = t->table;
-   int items = t->size / sizeof(Elf_Sym);
+   Elf_Addr start;
+   Elf_Addr end;
+   unsigned long long priority;   // Where intervals overlap, the lowest priority value wins
+   int item;
+}
+mxInterval_t;
+
+static int addrcompare(const void *a, const void *b)
+{
+   Elf_Addr da = *(const Elf_Addr *)a;
+   Elf_Addr db = *(const Elf_Addr *)b;
+   return da < db ? -1 : da > db;
+}
+
+static int intervalcompare(const void *a, const void *b)
+{
+   return addrcompare(&(static_cast<const mxInterval_t *>(a)->start), &(static_cast<const mxInterval_t *>(b)->start));
+}
+
+static void heapPush(const mxInterval_t *in, int *heap, int *n, int item)
+{
+   int i = (*n)++;
+   while (i && in[heap[(i-1)/2]].priority > in[item].priority)
+   {
+      heap[i] = heap[(i-1)/2];
+      i = (i-1)/2;
+   }
+   heap[i] = item;
+}
+
+static void heapPop(const mxInterval_t *in, int *heap, int *n)
+{
+   int item = heap[--(*n)];
    int i = 0;
+   while (2*i+1 < *n)
+   {
+      int child = 2*i+1;
+      if (child+1 < *n && in[heap[child+1]].priority < in[heap[child]].priority)
+         child++;
+      if (in[heap[child]].priority >= in[item].priority)
+         break;
+      heap[i] = heap[child];
+      i = child;
+   }
+   heap[i] = item;
+}
 
-   for (i = 0; i < items; i++, symbol++)
+// Flattens possibly overlapping intervals into a sorted list of non-overlapping ones, where each
+// address belongs to the interval with the lowest priority value covering it.  The input is sorted
+// in place.  Returns the number of intervals written to *out, which the caller must free.
+static int flattenIntervals(mxInterval_t *in, int n, mxInterval_t **out)
+{
+   *out = NULL;
+   if (!n)
+      return 0;
+
+   Elf_Addr *bounds = static_cast<Elf_Addr *>(malloc(2 * n * sizeof(Elf_Addr)));
+   for (int i = 0; i < n; i++)
    {
-      if (symbol->st_size && symbol->st_value && symbol->st_shndx)
+      bounds[2*i] = in[i].start;
+      bounds[2*i+1] = in[i].end;
+   }
+   qsort(bounds, 2*n, sizeof(Elf_Addr), addrcompare);
+   qsort(in, n, sizeof(mxInterval_t), intervalcompare);
+
+   int *heap = static_cast<int *>(malloc(n * sizeof(int)));
+   int nheap = 0;
+   int nout = 0;
+   *out = static_cast<mxInterval_t *>(malloc(2 * n * sizeof(mxInterval_t)));
+
+   int next = 0;
+   for (int b = 0; b < 2*n-1; b++)
+   {
+      if (bounds[b] == bounds[b+1])
+         continue;
+
+      while (next < n && in[next].start <= bounds[b])
+         heapPush(in, heap, &nheap, next++);
+
+      // Entries which have ended are only removed once they reach the top
+      while (nheap && in[heap[0]].end <= bounds[b])
+         heapPop(in, heap, &nheap);
+
+      if (!nheap)
+         continue;
+
+      int item = heap[0];
+      if (nout && (*out)[nout-1].item == in[item].item && (*out)[nout-1].end == bounds[b])
       {
-         //debug("found symbol " FMT_ADR " sized " FMT_ADR ", named %s\n", symbol->st_value, symbol->st_size, t->strings+symbol->st_name);
-         if (vmAddr >= t->baseAddr + symbol->st_value && vmAddr < t->baseAddr + symbol->st_value + symbol->st_size)
+         (*out)[nout-1].end = bounds[b+1];
+      }
+      else
+      {
+         (*out)[nout] = in[item];
+         (*out)[nout].start = bounds[b];
+         (*out)[nout].end = bounds[b+1];
+         nout++;
+      }
+   }
+
+   free(heap);
+   free(bounds);
+   return nout;
+}
+
+static void buildSegmentView(const mxProc *c, const int *order, int nOrder, int readOnly, mxSegmentIndex_t *index)
+{
+   // Mirrors the search in getFileAddrFromCoreLinear().  Files are searched in the given order and
+   // the first segment holding the address in the file wins.  If none do, the last segment which
+   // only covers it in memory wins, and reads from it return null values.  With readOnly, only the
+   // file data of segments which can't be written to is included.
+   int maxPieces = 0;
+   for (int r = 0; r < nOrder; r++)
+      maxPieces += 2 * c->elfFile[order[r]].phs.nph;
+
+   mxSegment_t *pieces = static_cast<mxSegment_t *>(malloc((maxPieces + 1) * sizeof(mxSegment_t)));
+   mxInterval_t *in = static_cast<mxInterval_t *>(malloc((maxPieces + 1) * sizeof(mxInterval_t)));
+   int n = 0;
+
+   for (int r = 0; r < nOrder; r++)
+   {
+      int fd = order[r];
+      Elf_Addr baseAddr = c->elfFile[fd].phs.baseAddr;
+
+      for (int i = 0; i < c->elfFile[fd].phs.nph; i++)
+      {
+         const Elf_Phdr *ph = c->elfFile[fd].phs.ph+i;
+         if (ph->p_type != PT_LOAD || !ph->p_filesz || (readOnly && (ph->p_flags & PF_W)))
+            continue;
+
+         if (ph->p_memsz < ph->p_filesz)
          {
-            *offset = vmAddr - t->baseAddr - symbol->st_value;
-            return t->strings + symbol->st_name;
+            // This shouldn't happen
+            warning("Program Header %d file size (%#lx) is bigger than memory size (%#lx).  Ignoring.",
+                    i, (unsigned long) ph->p_filesz, (unsigned long) ph->p_memsz);
+            continue;
+         }
+
+         Elf_Addr start = baseAddr + (Elf_Addr) ph->p_vaddr;
+
+         pieces[n].start = start;
+         pieces[n].end = start + ph->p_filesz;
+         pieces[n].fileAddr = ph->p_offset;
+         pieces[n].elfID = fd;
+         in[n].start = pieces[n].start;
+         in[n].end = pieces[n].end;
+         in[n].priority = ((unsigned long long) r << 31) | i;
+         in[n].item = n;
+         n++;
+
+         if (ph->p_memsz > ph->p_filesz && !readOnly)
+         {
+            pieces[n].start = start + ph->p_filesz;
+            pieces[n].end = start + ph->p_memsz;
+            pieces[n].fileAddr = ADDR_NULLVALUES;
+            pieces[n].elfID = fd;
+            in[n].start = pieces[n].start;
+            in[n].end = pieces[n].end;
+            in[n].priority = (1ULL << 62) | ((unsigned long long) (0x7fffffff - r) << 31) | (0x7fffffff - i);
+            in[n].item = n;
+            n++;
+         }
+      }
+   }
+
+   mxInterval_t *flat;
+   index->n = flattenIntervals(in, n, &flat);
+   index->seg = static_cast<mxSegment_t *>(malloc((index->n + 1) * sizeof(mxSegment_t)));
+
+   for (int i = 0; i < index->n; i++)
+   {
+      const mxSegment_t *piece = pieces + flat[i].item;
+      index->seg[i] = *piece;
+      index->seg[i].start = flat[i].start;
+      index->seg[i].end = flat[i].end;
+      if (piece->fileAddr != ADDR_NULLVALUES)
+         index->seg[i].fileAddr = piece->fileAddr + (flat[i].start - piece->start);
+   }
+
+   free(flat);
+   free(in);
+   free(pieces);
+}
+
+void freeSegmentIndex(mxProc *c)
+{
+   if (!c->nIndexedElfs)
+      return;
+
+   free(c->coreFirstIndex.seg);
+   free(c->coreLastIndex.seg);
+   for (int i = 0; i < c->nIndexedElfs; i++)
+      free(c->fileIndex[i].seg);
+   free(c->fileIndex);
+   free(c->readOnlyIndex.seg);
+
+   c->fileIndex = NULL;
+   c->coreFirstIndex.seg = c->coreLastIndex.seg = c->readOnlyIndex.seg = NULL;
+   c->coreFirstIndex.n = c->coreLastIndex.n = c->readOnlyIndex.n = 0;
+   c->nIndexedElfs = 0;
+}
+
+static void buildReadOnlyIndex(mxProc *c)
+{
+   // Read only segments of the binary and libraries can be read from our own mapping of the file
+   // rather than from the live process.  Only keep ranges the process maps entirely from the very file we
+   // opened, which catches files replaced or deleted since they were loaded, and as an extra check
+   // whose first page matches the process.
+   static const size_t pageSize = sysconf(_SC_PAGESIZE);
+   int *order = static_cast<int *>(malloc(c->elfOpen * sizeof(int)));
+   for (int fd = 0; fd < c->elfOpen; fd++)
+      order[fd] = fd;
+   buildSegmentView(c, order, c->elfOpen, 1, &c->readOnlyIndex);
+   free(order);
+
+   char *fromFile = static_cast<char *>(malloc(2 * pageSize));
+   char *fromProc = fromFile + pageSize;
+   int n = 0;
+   for (int i = 0; i < c->readOnlyIndex.n; i++)
+   {
+      const mxSegment_t *seg = c->readOnlyIndex.seg + i;
+      if (!isFileMappedAt(c, seg->start, seg->end, &c->elfFile[seg->elfID].stat))
+      {
+         debug("%s at " FMT_ADR " isn't the file the process maps, so it will be read from the process",
+               c->elfFile[seg->elfID].fileName, seg->start);
+         continue;
+      }
+
+      size_t size = seg->end - seg->start < pageSize ? seg->end - seg->start : pageSize;
+      readFile(c, seg->elfID, seg->fileAddr, fromFile, size);
+      if (readVMFromPID(c, seg->start, fromProc, size) || memcmp(fromFile, fromProc, size))
+      {
+         debug("%s at " FMT_ADR " doesn't match the process, so it will be read from the process",
+               c->elfFile[seg->elfID].fileName, seg->start);
+         continue;
+      }
+      c->readOnlyIndex.seg[n++] = *seg;
+   }
+   free(fromFile);
+
+   debug("%d of %d read only ranges will be read from their files", n, c->readOnlyIndex.n);
+   c->readOnlyIndex.n = n;
+}
+
+void buildSegmentIndex(mxProc *c)
+{
+   // Called once all elf files are open.  If any more are opened, lookups revert to a linear search.
+   freeSegmentIndex(c);
+
+   if (!c->elfOpen)
+      return;
+
+   int *order = static_cast<int *>(malloc(c->elfOpen * sizeof(int)));
+   int nSegments = 0;
+
+   for (int fd = 0; fd < c->elfOpen; fd++)
+      order[fd] = fd;
+   buildSegmentView(c, order, c->elfOpen, 0, &c->coreFirstIndex);
+
+   // CORELAST has always searched down to file 1 and never the core itself
+   for (int fd = 0; fd < c->elfOpen - 1; fd++)
+      order[fd] = c->elfOpen - 1 - fd;
+   buildSegmentView(c, order, c->elfOpen - 1, 0, &c->coreLastIndex);
+
+   c->fileIndex = static_cast<mxSegmentIndex_t *>(malloc(c->elfOpen * sizeof(mxSegmentIndex_t)));
+   for (int fd = 0; fd < c->elfOpen; fd++)
+   {
+      buildSegmentView(c, &fd, 1, 0, c->fileIndex + fd);
+      nSegments += c->fileIndex[fd].n;
+   }
+
+   free(order);
+   c->nIndexedElfs = c->elfOpen;
+
+   debug("Indexed %d segments from %d elf files into %d address ranges", nSegments, c->elfOpen, c->coreFirstIndex.n);
+
+   if (c->type == mxProcTypePID)
+      buildReadOnlyIndex(c);
+}
+
+static const mxSegment_t *searchSegmentIndex(const mxSegmentIndex_t *index, Elf_Addr vmAddr)
+{
+   // Find the last range starting at or before vmAddr
+   int lo = 0;
+   int hi = index->n;
+   while (lo < hi)
+   {
+      int mid = lo + (hi - lo) / 2;
+      if (index->seg[mid].start <= vmAddr)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (lo && vmAddr < index->seg[lo-1].end)
+      return index->seg + lo - 1;
+
+   return NULL;
+}
+
+void adviseMxProcVM(const mxProc *p, Elf_Addr vmAddr, size_t size)
+{
+   // Hint that [vmAddr, vmAddr+size) is about to be read in order, e.g. when scanning a stack.
+   // The range is clipped to the segment holding vmAddr.  Only useful for cores.
+   if (p->type != mxProcTypeCore || !p->nIndexedElfs || p->nIndexedElfs != p->elfOpen)
+      return;
+
+   const mxSegment_t *seg = searchSegmentIndex(&p->coreFirstIndex, vmAddr);
+   if (!seg || seg->fileAddr == ADDR_NULLVALUES)
+      return;
+
+   if (size > seg->end - vmAddr)
+      size = seg->end - vmAddr;
+
+   long pageSize = sysconf(_SC_PAGESIZE);
+   Elf_Addr fileAddr = seg->fileAddr + (vmAddr - seg->start);
+
+   while (size)
+   {
+      size_t available = 0;
+      mxFileWindow_t *window;
+      const char *data = getMappedFileData(p, seg->elfID, fileAddr, &available, &window);
+      if (!data)
+         break;
+
+      size_t n = size < available ? size : available;
+      size_t align = (Elf_Addr) data % pageSize;
+      madvise(const_cast<char *>(data - align), n + align, MADV_WILLNEED);
+      unpinFileWindow(window);
+      fileAddr += n;
+      size -= n;
+   }
+}
+
+static __thread mxStackSnapshot_t stackSnapshot;
+
+static int getStackRange(const mxProc *p, mxLWP_t t, Elf_Addr *low, size_t *size)
+{
+   // Finds the used part of the stack of t, from just below sp to the top of the stack mapping.  Returns 0 if found.
+   Elf_Addr sp = t.sp;
+#if (defined(__sparc) && defined (_LP64))
+   sp += 0x7ff;
+#endif
+
+   Elf_Addr start = 0, end = 0;
+   if (t.stack)
+   {
+      start = t.stack;
+      end = t.stack + t.stacksize;
+   }
+   else if (p->type == mxProcTypeCore)
+   {
+      if (!p->nIndexedElfs || p->nIndexedElfs != p->elfOpen)
+         return 1;
+
+      const mxSegment_t *seg = searchSegmentIndex(&p->coreFirstIndex, sp);
+      if (!seg || seg->fileAddr == ADDR_NULLVALUES)
+         return 1;
+
+      start = seg->start;
+      end = seg->end;
+   }
+   else if (getVMRegionFromPID(p, sp, &start, &end))
+   {
+      return 1;
+   }
+
+   if (sp < start || sp >= end)
+      return 1;
+
+   // Corrupt stack searches look a little below sp
+   long pageSize = sysconf(_SC_PAGESIZE);
+   *low = sp - sp % pageSize;
+   if (*low - start >= (Elf_Addr) pageSize)
+      *low -= pageSize;
+   else
+      *low = start;
+
+   *size = end - *low;
+   if (*size > MAX_STACK_SNAPSHOT)
+      *size = MAX_STACK_SNAPSHOT;
+
+   return 0;
+}
+
+void snapshotStack(const mxProc *p, mxLWP_t t)
+{
+   // Copy the stack of t so that unwinding it is served from memory, see readStackSnapshot()
+   releaseStackSnapshot();
+
+   Elf_Addr low = 0;
+   size_t size = 0;
+   if (getStackRange(p, t, &low, &size))
+      return;
+
+   char *data = static_cast<char *>(malloc(size));
+   if (!data || readMxProcVM(p, low, data, size))
+   {
+      debug("Unable to snapshot %lu bytes of stack at " FMT_ADR, (unsigned long) size, (unsigned long) low);
+      free(data);
+      return;
+   }
+
+   debug("Snapshot %lu bytes of stack at " FMT_ADR " for LWP %d", (unsigned long) size, (unsigned long) low, t.lwpID);
+   stackSnapshot.start = low;
+   stackSnapshot.size = size;
+   stackSnapshot.data = data;
+}
+
+void releaseStackSnapshot()
+{
+   free(stackSnapshot.data);
+   stackSnapshot.data = NULL;
+   stackSnapshot.start = 0;
+   stackSnapshot.size = 0;
+}
+
+void setStackSnapshot(Elf_Addr start, const void *data, size_t size)
+{
+   // Serves reads of [start, start + size) from a copy of data, e.g. a stack captured by a perf event
+   releaseStackSnapshot();
+   if (!size)
+      return;
+
+   stackSnapshot.data = static_cast<char *>(malloc(size));
+   memcpy(stackSnapshot.data, data, size);
+   stackSnapshot.start = start;
+   stackSnapshot.size = size;
+}
+
+int readStackSnapshot(Elf_Addr vmAddr, void *buff, size_t size)
+{
+   // Returns 0 if the read was served from the stack snapshot
+   if (!stackSnapshot.size || vmAddr < stackSnapshot.start || vmAddr - stackSnapshot.start > stackSnapshot.size
+       || size > stackSnapshot.size - (vmAddr - stackSnapshot.start))
+      return 1;
+
+   memcpy(buff, stackSnapshot.data + (vmAddr - stackSnapshot.start), size);
+   return 0;
+}
+
+// Extra ranges copied by captureMemorySnapshot(), e.g. heap areas holding the arguments of interest
+#define MAX_SNAPSHOT_RANGES 32
+static int nSnapshotRanges = 0;
+static mxStackSnapshot_t snapshotRanges[MAX_SNAPSHOT_RANGES];
+
+void addSnapshotRange(Elf_Addr start, size_t size)
+{
+   if (nSnapshotRanges == MAX_SNAPSHOT_RANGES)
+   {
+      warning("Only %d snapshot ranges are supported.  Ignoring " FMT_ADR, MAX_SNAPSHOT_RANGES, (unsigned long) start);
+      return;
+   }
+
+   snapshotRanges[nSnapshotRanges].start = start;
+   snapshotRanges[nSnapshotRanges].size = size;
+   nSnapshotRanges++;
+}
+
+static int regioncompare(const void *a, const void *b)
+{
+   Elf_Addr ia = static_cast<const mxStackSnapshot_t *>(a)->start;
+   Elf_Addr ib = static_cast<const mxStackSnapshot_t *>(b)->start;
+   return ia < ib ? -1 : ia > ib;
+}
+
+static void freeMemorySnapshot(mxProc *p)
+{
+   if (!p->memorySnapshot)
+      return;
+
+   for (int i = 0; i < p->memorySnapshot->nRegions; i++)
+      free(p->memorySnapshot->region[i].data);
+   free(p->memorySnapshot->region);
+   free(p->memorySnapshot);
+   p->memorySnapshot = NULL;
+}
+
+int copyStack(const mxProc *p, mxLWP_t t, mxStackSnapshot_t *region)
+{
+   // Copies the used part of the stack of t into region.  Returns 0 on success.
+   if (getStackRange(p, t, &region->start, &region->size))
+   {
+      debug("Unable to find the stack of LWP %d", t.lwpID);
+      return 1;
+   }
+
+   region->data = static_cast<char *>(malloc(region->size));
+   if (!region->data || readMxProcVM(p, region->start, region->data, region->size))
+   {
+      warning("Unable to snapshot %lu bytes at " FMT_ADR, (unsigned long) region->size, (unsigned long) region->start);
+      free(region->data);
+      region->data = NULL;
+      return 1;
+   }
+
+   return 0;
+}
+
+void setMemorySnapshot(mxProc *p, mxMemorySnapshot_t *snapshot)
+{
+   // Replaces the memory snapshot of p.  Its regions are sorted here.
+   freeMemorySnapshot(p);
+   if (!snapshot)
+      return;
+
+   qsort(snapshot->region, snapshot->nRegions, sizeof(mxStackSnapshot_t), regioncompare);
+   p->memorySnapshot = snapshot;
+}
+
+void captureMemorySnapshot(mxProc *p)
+{
+   // Copies the stack of every LWP, and the snapshot ranges, so that the process can be let go before unwinding
+   freeMemorySnapshot(p);
+
+   mxMemorySnapshot_t *snapshot = static_cast<mxMemorySnapshot_t *>(calloc(1, sizeof(mxMemorySnapshot_t)));
+   snapshot->region = static_cast<mxStackSnapshot_t *>(calloc(p->nLWPs + nSnapshotRanges, sizeof(mxStackSnapshot_t)));
+   size_t total = 0;
+
+   for (int i = 0; i < p->nLWPs + nSnapshotRanges; i++)
+   {
+      mxStackSnapshot_t *region = snapshot->region + snapshot->nRegions;
+
+      if (i < p->nLWPs)
+      {
+         if (copyStack(p, p->LWPs[i], region))
+            continue;
+      }
+      else
+      {
+         *region = snapshotRanges[i - p->nLWPs];
+         region->data = static_cast<char *>(malloc(region->size));
+         if (!region->data || readMxProcVM(p, region->start, region->data, region->size))
+         {
+            warning("Unable to snapshot %lu bytes at " FMT_ADR, (unsigned long) region->size, (unsigned long) region->start);
+            free(region->data);
+            region->data = NULL;
+            continue;
+         }
+      }
+
+      total += region->size;
+      snapshot->nRegions++;
+   }
+
+   debug("Snapshot %lu bytes in %d regions", (unsigned long) total, snapshot->nRegions);
+   setMemorySnapshot(p, snapshot);
+}
+
+int readMemorySnapshot(const mxProc *p, Elf_Addr vmAddr, void *buff, size_t size)
+{
+   // Returns 0 if the read was served from the memory snapshot
+   const mxMemorySnapshot_t *snapshot = p->memorySnapshot;
+   if (!snapshot || !snapshot->nRegions)
+      return 1;
+
+   // Find the last region starting at or before vmAddr
+   int lo = 0, hi = snapshot->nRegions;
+   while (lo < hi)
+   {
+      int mid = (lo + hi) / 2;
+      if (snapshot->region[mid].start <= vmAddr)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (!lo)
+      return 1;
+
+   const mxStackSnapshot_t *region = snapshot->region + lo - 1;
+   if (vmAddr - region->start > region->size || size > region->size - (vmAddr - region->start))
+      return 1;
+
+   memcpy(buff, region->data + (vmAddr - region->start), size);
+   return 0;
+}
+
+void getFileAddrFromCore(const mxProc *c, Elf_Addr vmAddr, Elf_Addr *fileAddr, int *elfFile, int so)
+{
+   if (!c->nIndexedElfs || c->nIndexedElfs != c->elfOpen)
+   {
+      getFileAddrFromCoreLinear(c, vmAddr, fileAddr, elfFile, so);
+      return;
+   }
+
+   const mxSegmentIndex_t *index;
+   if (so == CORELAST)
+      index = &c->coreLastIndex;
+   else if (so == COREONLY)
+      index = c->fileIndex;
+   else if (so == FILEONLY)
+      index = (*elfFile >= 0 && *elfFile < c->nIndexedElfs) ? c->fileIndex + *elfFile : NULL;
+   else
+      index = &c->coreFirstIndex;
+
+   const mxSegment_t *seg = index ? searchSegmentIndex(index, vmAddr) : NULL;
+
+   if (!seg)
+   {
+      *fileAddr = 0;
+      *elfFile = 0;
+   }
+   else
+   {
+      *fileAddr = seg->fileAddr == ADDR_NULLVALUES ? ADDR_NULLVALUES : seg->fileAddr + (vmAddr - seg->start);
+      *elfFile = seg->elfID;
+   }
+}
+
+static int readSegmentsVM(const mxProc *p, const mxSegmentIndex_t *index, Elf_Addr vmAddr, char *buff, size_t size)
+{
+   // A range may cover several segments, each backed by a different file.  Read it a segment at a time,
+   // leaving the unused tails of segments (ADDR_NULLVALUES) as the zeros already in buff.
+   size_t done = 0;
+   while (done < size)
+   {
+      Elf_Addr addr = vmAddr + done;
+      const mxSegment_t *seg = searchSegmentIndex(index, addr);
+      if (!seg)
+      {
+         if (done)
+            debug("Memory address goes beyond mapped areas (base " FMT_ADR " + size %#lx).  Check pmap.", vmAddr, size);
+         else
+            debug("Could not find vm address " FMT_ADR ".  Check pmap.", vmAddr);
+         return 1;
+      }
+
+      size_t length = size - done;
+      if (length > seg->end - addr)
+         length = seg->end - addr;
+      if (seg->fileAddr != ADDR_NULLVALUES)
+         readFile(p, seg->elfID, seg->fileAddr + (addr - seg->start), buff + done, length);
+      done += length;
+   }
+
+   return 0;
+}
+
+int readCoreVM(const mxProc *p, Elf_Addr vmAddr, void *buffPointer, size_t size)
+{
+   // The core part of readMxProcVM.  buffPointer must already be zeroed.
+   char *buff = static_cast<char *>(buffPointer);
+
+   if (p->nIndexedElfs && p->nIndexedElfs == p->elfOpen)
+      return readSegmentsVM(p, &p->coreFirstIndex, vmAddr, buff, size);
+
+   // Until the segment index is built, the whole range has to come from a single file
+   Elf_Addr fileAddr = 0;
+   int elfFile = 0;
+   getFileAddrFromCore(p, vmAddr, &fileAddr, &elfFile, COREFIRST);
+
+   if (!fileAddr)
+   {
+      debug("Could not find vm address " FMT_ADR " in the core file.  Check pmap.", vmAddr);
+      return 1;
+   }
+
+   Elf_Addr endAddr = 0;
+   int endElfFile = 0;
+   getFileAddrFromCore(p, vmAddr + size - 1, &endAddr, &endElfFile, COREFIRST);
+
+   if (!endAddr)
+   {
+      debug("Memory address goes beyond mapped areas (base " FMT_ADR " + size %#lx).  Check pmap.", vmAddr, size);
+      return 1;
+   }
+
+   if (elfFile!=endElfFile)
+   {
+      debug("Memory address " FMT_ADR " goes across 2 elf files.", vmAddr);
+      return 1;
+   }
+
+   if (fileAddr == ADDR_NULLVALUES && endAddr == ADDR_NULLVALUES)
+   {
+      // Valid, but unused memory space.  Return null values.
+      return 0;
+   }
+   else if (fileAddr == ADDR_NULLVALUES || endAddr == ADDR_NULLVALUES)
+   {
+#ifdef __sun
+      // Solaris has always warned and returned null values here
+      warning("Reads across used/unused memory boundaries are not supported (base " FMT_ADR " + size %#lx).", vmAddr, size);
+      return 0;
+#else
+      debug("Reads across used/unused memory boundaries are not supported (base " FMT_ADR " + size %#lx).", vmAddr, size);
+      return 1;
+#endif
+   }
+
+   readFile(p, elfFile, fileAddr, buff, size);
+   return 0;
+}
+
+void setPageCacheSize(long blocks)
+{
+   // Clamped, as the hash table is sized to the next power of 2 above twice the number of blocks
+   if (blocks > MAX_PAGE_CACHE_BLOCKS)
+   {
+      warning("The page cache is limited to %d blocks", MAX_PAGE_CACHE_BLOCKS);
+      blocks = MAX_PAGE_CACHE_BLOCKS;
+   }
+   pageCacheBlocks = blocks > 0 ? blocks : 0;
+}
+
+static pthread_mutex_t pageCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The last blocks used by this LWP, indexed by block address
+typedef struct
+{
+   const mxPageCache_t *cache;
+   unsigned long generation;
+   Elf_Addr addr;
+   char data[PAGE_CACHE_BLOCK];
+}
+mxCacheCopy_t;
+
+static __thread mxCacheCopy_t pageCacheL1[PAGE_CACHE_L1_BLOCKS];
+
+static mxCacheBlock_t **findCacheBlock(mxPageCache_t *cache, Elf_Addr addr)
+{
+   // Returns the hash chain link pointing at the block for addr, or at the NULL ending the chain
+   mxCacheBlock_t **link = cache->hash + ((addr / PAGE_CACHE_BLOCK) & cache->hashMask);
+   while (*link && (*link)->addr != addr)
+      link = &(*link)->hashNext;
+   return link;
+}
+
+static void unlinkCacheBlock(mxPageCache_t *cache, mxCacheBlock_t *b)
+{
+   if (b->newer)
+      b->newer->older = b->older;
+   else
+      cache->newest = b->older;
+   if (b->older)
+      b->older->newer = b->newer;
+   else
+      cache->oldest = b->newer;
+}
+
+static void linkCacheBlock(mxPageCache_t *cache, mxCacheBlock_t *b)
+{
+   b->newer = NULL;
+   b->older = cache->newest;
+   if (cache->newest)
+      cache->newest->newer = b;
+   else
+      cache->oldest = b;
+   cache->newest = b;
+}
+
+static void addCacheBlock(mxPageCache_t *cache, Elf_Addr addr, const char *data)
+{
+   // Must be called with pageCacheMutex held
+   if (!cache->block)
+   {
+      unsigned int hashSize = 1;
+      while (hashSize < 2 * (unsigned int) cache->maxBlocks)
+         hashSize *= 2;
+      cache->hashMask = hashSize - 1;
+      cache->hash = static_cast<mxCacheBlock_t **>(calloc(hashSize, sizeof(mxCacheBlock_t *)));
+      cache->block = static_cast<mxCacheBlock_t *>(calloc(cache->maxBlocks, sizeof(mxCacheBlock_t)));
+      cache->data = static_cast<char *>(malloc((size_t) cache->maxBlocks * PAGE_CACHE_BLOCK));
+      if (!cache->hash || !cache->block || !cache->data)
+         fatal_error("Out of memory allocating a cache of %d blocks", cache->maxBlocks);
+   }
+
+   mxCacheBlock_t *b;
+   if (cache->nBlocks < cache->maxBlocks)
+   {
+      b = cache->block + cache->nBlocks;
+      b->data = cache->data + (size_t) cache->nBlocks++ * PAGE_CACHE_BLOCK;
+   }
+   else
+   {
+      b = cache->oldest;
+      unlinkCacheBlock(cache, b);
+      *findCacheBlock(cache, b->addr) = b->hashNext;
+   }
+
+   mxCacheBlock_t **link = findCacheBlock(cache, addr);
+   b->addr = addr;
+   b->hashNext = *link;
+   *link = b;
+   memcpy(b->data, data, PAGE_CACHE_BLOCK);
+   linkCacheBlock(cache, b);
+}
+
+static const char *getCachedBlock(const mxProc *p, Elf_Addr addr)
+{
+   // Returns the block at addr, or NULL if it can't be read.  The cache is only invalidated while
+   // no other threads are reading, so the generation can be checked without the mutex.
+   mxPageCache_t *cache = p->pageCache;
+   mxCacheCopy_t *copy = pageCacheL1 + (addr / PAGE_CACHE_BLOCK) % PAGE_CACHE_L1_BLOCKS;
+   if (copy->cache == cache && copy->generation == cache->generation && copy->addr == addr)
+   {
+      __sync_fetch_and_add(&cache->l1Hits, 1);
+      return copy->data;
+   }
+
+   pthread_mutex_lock(&pageCacheMutex);
+   unsigned long generation = cache->generation;
+   mxCacheBlock_t *b = cache->block ? *findCacheBlock(cache, addr) : NULL;
+   if (b)
+   {
+      unlinkCacheBlock(cache, b);
+      linkCacheBlock(cache, b);
+      memcpy(copy->data, b->data, PAGE_CACHE_BLOCK);
+      cache->l2Hits++;
+   }
+   else
+   {
+      cache->misses++;
+   }
+   pthread_mutex_unlock(&pageCacheMutex);
+
+   if (!b)
+   {
+      // Read without holding the mutex, so other LWPs aren't held up
+      if (readVMFromPID(p, addr, copy->data, PAGE_CACHE_BLOCK))
+      {
+         copy->cache = NULL;
+         return NULL;
+      }
+
+      pthread_mutex_lock(&pageCacheMutex);
+      if (generation == cache->generation && !(cache->block && *findCacheBlock(cache, addr)))
+         addCacheBlock(cache, addr, copy->data);
+      pthread_mutex_unlock(&pageCacheMutex);
+   }
+
+   copy->cache = cache;
+   copy->generation = generation;
+   copy->addr = addr;
+   return copy->data;
+}
+
+static int readCachedVM(const mxProc *p, Elf_Addr vmAddr, char *buff, size_t size)
+{
+   // Type printers make many small reads close to each other, so reads from a live process go
+   // through a cache of PAGE_CACHE_BLOCK sized blocks.  Large reads, e.g. of stacks, go straight to the
+   // process, as do reads of blocks which can't be read whole, so they fail as they always have.
+   if (!p->pageCache->maxBlocks || size > PAGE_CACHE_BLOCK)
+      return readVMFromPID(p, vmAddr, buff, size);
+
+   size_t done = 0;
+   while (done < size)
+   {
+      Elf_Addr addr = vmAddr + done;
+      Elf_Addr blockAddr = addr - addr % PAGE_CACHE_BLOCK;
+      const char *data = getCachedBlock(p, blockAddr);
+      if (!data)
+         return readVMFromPID(p, vmAddr, buff, size);
+
+      size_t length = PAGE_CACHE_BLOCK - (addr - blockAddr);
+      if (length > size - done)
+         length = size - done;
+      memcpy(buff + done, data + (addr - blockAddr), length);
+      done += length;
+   }
+
+   return 0;
+}
+
+void invalidatePageCache(const mxProc *p)
+{
+   // Called whenever a live process may have run since its memory was cached
+   mxPageCache_t *cache = p->pageCache;
+
+   pthread_mutex_lock(&pageCacheMutex);
+   if (cache->block)
+      memset(cache->hash, 0, (cache->hashMask + 1) * sizeof(mxCacheBlock_t *));
+   cache->nBlocks = 0;
+   cache->newest = cache->oldest = NULL;
+   cache->generation = ++pageCacheGeneration;
+   pthread_mutex_unlock(&pageCacheMutex);
+}
+
+static void freePageCache(mxPageCache_t *cache)
+{
+   unsigned long reads = cache->l1Hits + cache->l2Hits + cache->misses;
+   if (reads)
+      debug("Page cache: %lu block reads, %.1f%% from this LWP's copies, %.1f%% from the shared cache, %lu misses",
+            reads, 100.0 * cache->l1Hits / reads, 100.0 * cache->l2Hits / reads, cache->misses);
+
+   free(cache->hash);
+   free(cache->block);
+   free(cache->data);
+   free(cache);
+}
+
+int readMxProcVM(const mxProc * p, Elf_Addr vmAddr, void *buffPointer, size_t size)
+{
+   // Memory comes from the first source holding all of it: stacks and ranges copied from a live process,
+   // read only segments of the binary and libraries, then the core or the live process itself (through
+   // its page cache).
+   char *buff = static_cast<char *>(buffPointer);
+
+   if (!readStackSnapshot(vmAddr, buff, size) || !readMemorySnapshot(p, vmAddr, buff, size))
+      return 0;
+
+   if (p->readOnlyIndex.n)
+   {
+      const mxSegment_t *seg = searchSegmentIndex(&p->readOnlyIndex, vmAddr);
+      if (seg && size <= seg->end - vmAddr)
+      {
+         readFile(p, seg->elfID, seg->fileAddr + (vmAddr - seg->start), buff, size);
+         return 0;
+      }
+   }
+
+   memset(buff, 0, size);       // Calling functions should check the return value, but in case they dont.....
+
+   if (p->type == mxProcTypeCore)
+      return readCoreVM(p, vmAddr, buff, size);
+   else if (p->type == mxProcTypePID)
+      return readCachedVM(p, vmAddr, buff, size);
+
+   fatal_error("Invalid MxProcType.");
+   return 1;
+}
+
+static const char *searchSymbolTable(const mxSymTab_t * t, Elf_Addr vmAddr, Elf_Off * offset)
+{
+   const Elf_Sym *symbol = t->table;
+   int items = t->size / sizeof(Elf_Sym);
+   int i = 0;
+
+   for (i = 0; i < items; i++, symbol++)
+   {
+      if (symbol->st_size && symbol->st_value && symbol->st_shndx)
+      {
+         //debug("found symbol " FMT_ADR " sized " FMT_ADR ", named %s\n", symbol->st_value, symbol->st_size, t->strings+symbol->st_name);
+         if (vmAddr >= t->baseAddr + symbol->st_value && vmAddr < t->baseAddr + symbol->st_value + symbol->st_size)
+         {
+            *offset = vmAddr - t->baseAddr - symbol->st_value;
+            return t->strings + symbol->st_name;
+         }
+      }
+   }
+
+   return 0;
+}
+
+const char *getUnknownSymbol()
+{
+   return unknownSymbol;
+}
+
+static const char *getSymbolNameLinear(const mxProc * c, Elf_Addr vmAddr, Elf_Off * offset)
+{
+   int i;
+
+   *offset = 0;
+   const char *symbolName = NULL;
+
+   for (i = 0; i < c->nsymtabs; i++)
+   {
+      symbolName = searchSymbolTable(c->symtab + i, vmAddr, offset);
+      if (symbolName && symbolName[0])
+         return symbolName;
+   }
+
+   return getUnknownSymbol();
+}
+
+static const Elf_Shdr *getSymbolSection(const mxProc *c, const mxSymTab_t *t, const Elf_Sym *symbol)
+{
+   // Section header of the section a symbol is defined in, if it's available
+   const mxElfFile *f = c->elfFile + t->elfID;
+   const Elf_Ehdr *elfHdr = static_cast<const Elf_Ehdr *>(f->mmloc);
+
+   if (!elfHdr || symbol->st_shndx >= SHN_LORESERVE || symbol->st_shndx >= elfHdr->e_shnum
+       || elfHdr->e_shoff + elfHdr->e_shnum * sizeof(Elf_Shdr) > f->mmsize)
+      return NULL;
+
+   return reinterpret_cast<const Elf_Shdr *>(static_cast<const char *>(f->mmloc) + elfHdr->e_shoff) + symbol->st_shndx;
+}
+
+void freeSymbolIndex(mxProc *c)
+{
+   free(c->symbolIndex.range);
+   c->symbolIndex.range = NULL;
+   c->symbolIndex.n = 0;
+   c->nIndexedSymtabs = 0;
+}
+
+void buildSymbolIndex(mxProc *c)
+{
+   // Called once all symbols are loaded.  If any more are loaded, lookups revert to a linear search.
+   // Where symbols overlap, SYMTAB beats DYNSYM, then earlier tables win, then earlier symbols in a table.
+   // Zero sized code symbols (e.g. assembler labels) cover any gap up to the next symbol, but never beat a sized one.
+   freeSymbolIndex(c);
+
+   int n = 0;
+   for (int t = 0; t < c->nsymtabs; t++)
+      n += c->symtab[t].size / sizeof(Elf_Sym);
+
+   if (!n)
+      return;
+
+   mxInterval_t *in = static_cast<mxInterval_t *>(malloc(n * sizeof(mxInterval_t)));
+   Elf_Addr *starts = static_cast<Elf_Addr *>(malloc(n * sizeof(Elf_Addr)));
+   int nIn = 0;
+   int nStarts = 0;
+
+   for (int t = 0; t < c->nsymtabs; t++)
+   {
+      const mxSymTab_t *table = c->symtab + t;
+      int items = table->size / sizeof(Elf_Sym);
+
+      for (int i = 0; i < items; i++)
+      {
+         const Elf_Sym *symbol = table->table + i;
+         if (!symbol->st_value || !symbol->st_shndx || !table->strings[symbol->st_name])
+            continue;
+
+         Elf_Addr start = table->baseAddr + symbol->st_value;
+         starts[nStarts++] = start;
+
+         unsigned long long priority = ((unsigned long long) (table->type != SHT_SYMTAB) << 61) | ((unsigned long long) t << 31) | i;
+         if (symbol->st_size)
+         {
+            in[nIn].end = start + symbol->st_size;
+         }
+         else
+         {
+            int type = ELF_ST_TYPE(symbol->st_info);
+            const Elf_Shdr *section = getSymbolSection(c, table, symbol);
+            if ((type != STT_FUNC && type != STT_NOTYPE) || !section || !(section->sh_flags & SHF_EXECINSTR))
+               continue;
+
+            // The end is trimmed to the next symbol below
+            in[nIn].end = table->baseAddr + section->sh_addr + section->sh_size;
+            priority |= 1ULL << 62;
+         }
+
+         if (in[nIn].end <= start)
+            continue;
+
+         in[nIn].start = start;
+         in[nIn].priority = priority;
+         in[nIn].item = nIn;
+         nIn++;
+      }
+   }
+
+   // Stop zero sized symbols at the next symbol
+   qsort(starts, nStarts, sizeof(Elf_Addr), addrcompare);
+   for (int i = 0; i < nIn; i++)
+   {
+      if (!(in[i].priority & (1ULL << 62)))
+         continue;
+
+      int lo = 0, hi = nStarts;
+      while (lo < hi)
+      {
+         int mid = lo + (hi - lo) / 2;
+         if (starts[mid] <= in[i].start)
+            lo = mid + 1;
+         else
+            hi = mid;
+      }
+      if (lo < nStarts && starts[lo] < in[i].end)
+         in[i].end = starts[lo];
+   }
+   free(starts);
+
+   // flattenIntervals sorts its input, so keep what each item refers to
+   mxSymbolRange_t *symbols = static_cast<mxSymbolRange_t *>(malloc((nIn + 1) * sizeof(mxSymbolRange_t)));
+   for (int i = 0; i < nIn; i++)
+   {
+      int t = (in[i].priority >> 31) & 0x3fffffff;
+      const Elf_Sym *symbol = c->symtab[t].table + (in[i].priority & 0x7fffffff);
+      symbols[i].value = in[i].start;
+      symbols[i].name = symbol->st_name;
+      symbols[i].table = t;
+   }
+
+   mxInterval_t *flat;
+   c->symbolIndex.n = flattenIntervals(in, nIn, &flat);
+   c->symbolIndex.range = static_cast<mxSymbolRange_t *>(malloc((c->symbolIndex.n + 1) * sizeof(mxSymbolRange_t)));
+
+   for (int i = 0; i < c->symbolIndex.n; i++)
+   {
+      c->symbolIndex.range[i] = symbols[flat[i].item];
+      c->symbolIndex.range[i].start = flat[i].start;
+      c->symbolIndex.range[i].end = flat[i].end;
+   }
+
+   free(flat);
+   free(symbols);
+   free(in);
+   c->nIndexedSymtabs = c->nsymtabs;
+
+   debug("Indexed %d symbols from %d symbol tables into %d address ranges", nIn, c->nsymtabs, c->symbolIndex.n);
+}
+
+static const char *getSymbolName(const mxProc * c, Elf_Addr vmAddr, Elf_Off * offset)
+{
+   if (!c->nIndexedSymtabs || c->nIndexedSymtabs != c->nsymtabs)
+      return getSymbolNameLinear(c, vmAddr, offset);
+
+   *offset = 0;
+
+   // Find the last range starting at or before vmAddr
+   const mxSymbolIndex_t *index = &c->symbolIndex;
+   int lo = 0;
+   int hi = index->n;
+   while (lo < hi)
+   {
+      int mid = lo + (hi - lo) / 2;
+      if (index->range[mid].start <= vmAddr)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (!lo || vmAddr >= index->range[lo-1].end)
+      return getUnknownSymbol();
+
+   const mxSymbolRange_t *range = index->range + lo - 1;
+   *offset = vmAddr - range->value;
+   return c->symtab[range->table].strings + range->name;
+}
+
+static const char *getFileName(const mxProc *c, Elf_Addr vmAddr)
+{
+   Elf_Addr fileAddr = 0;
+   int elfFile = 0;
+   //Search the core last, as sometimes the binary code is there.  We are interested in the originating file
+   getFileAddrFromCore(c, vmAddr, &fileAddr, &elfFile, CORELAST);
+   return c->elfFile[elfFile].fileName;
+}
+
+
+// Arena allocations are aligned for any type, including the long doubles in mxArgument
+#define ARENA_ALIGN 16
+
+static size_t arenaPadding(const mxArenaBlock_t *block)
+{
+   // Bytes skipped at the start of block so that its data is aligned
+   uintptr_t data = reinterpret_cast<uintptr_t>(block + 1);
+   return (ARENA_ALIGN - data % ARENA_ALIGN) % ARENA_ALIGN;
+}
+
+static void *arenaAlloc(mxArena_t *a, size_t size)
+{
+   size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+   if (!a->head || a->head->used + size > a->head->size)
+   {
+      size_t blockSize = size > 65536 ? size : 65536;
+      mxArenaBlock_t *block = static_cast<mxArenaBlock_t *>(malloc(sizeof(mxArenaBlock_t) + blockSize + ARENA_ALIGN));
+      block->next = a->head;
+      block->used = arenaPadding(block);
+      block->size = block->used + blockSize;
+      a->head = block;
+   }
+
+   void *ret = reinterpret_cast<char *>(a->head + 1) + a->head->used;
+   a->head->used += size;
+   return ret;
+}
+
+static char *arenaStrdup(mxArena_t *a, const char *str)
+{
+   size_t len = strlen(str) + 1;
+   return static_cast<char *>(memcpy(arenaAlloc(a, len), str, len));
+}
+
+static void freeArena(mxArena_t *a)
+{
+   while (a->head)
+   {
+      mxArenaBlock_t *next = a->head->next;
+      free(a->head);
+      a->head = next;
+   }
+}
+
+static void resetArena(mxArena_t *a)
+{
+   // Frees all but the first block, which is kept for reuse
+   while (a->head && a->head->next)
+   {
+      mxArenaBlock_t *next = a->head->next;
+      free(a->head);
+      a->head = next;
+   }
+   if (a->head)
+      a->head->used = arenaPadding(a->head);
+}
+
+// Arguments are decoded one frame at a time by each thread, so they come from an arena that is reset after each frame
+static __thread mxArena_t argumentArena;
+
+mxArguments *newArguments()
+{
+   // Valid until releaseArguments() is called by this thread
+   mxArguments *args = static_cast<mxArguments *>(arenaAlloc(&argumentArena, sizeof(mxArguments)));
+   memset(args, 0, sizeof(mxArguments));
+   reserveArguments(&args->arg, &args->maxArgs, MIN_MERGED_ARGS);
+   return args;
+}
+
+void reserveArguments(mxArgument **array, int *maxArgs, int nArgs)
+{
+   // Makes room for nArgs in one of the arrays of an mxArguments.  New entries are zeroed.
+   if (nArgs <= *maxArgs)
+      return;
+
+   int newMax = 2 * *maxArgs > nArgs ? 2 * *maxArgs : nArgs;
+   mxArgument *grown = static_cast<mxArgument *>(arenaAlloc(&argumentArena, newMax * sizeof(mxArgument)));
+   if (*maxArgs)
+      memcpy(grown, *array, *maxArgs * sizeof(mxArgument));
+   memset(grown + *maxArgs, 0, (newMax - *maxArgs) * sizeof(mxArgument));
+
+   *array = grown;
+   *maxArgs = newMax;
+}
+
+void releaseArguments()
+{
+   resetArena(&argumentArena);
+}
+
+void freeArgumentArena()
+{
+   freeArena(&argumentArena);
+}
+
+static Elf_Word gnuHashName(const char *name)
+{
+   Elf_Word h = 5381;
+   for (const unsigned char *c = reinterpret_cast<const unsigned char *>(name); *c; c++)
+      h = h * 33 + *c;
+   return h;
+}
+
+static Elf_Word sysvHashName(const char *name)
+{
+   Elf_Word h = 0;
+   for (const unsigned char *c = reinterpret_cast<const unsigned char *>(name); *c; c++)
+   {
+      h = (h << 4) + *c;
+      Elf_Word g = h & 0xf0000000;
+      if (g)
+         h ^= g >> 24;
+      h &= ~g;
+   }
+   return h;
+}
+
+static int isDefinedSymbol(const mxSymTab_t *t, Elf_Word symIndex, const char *symbolName)
+{
+   if (symIndex >= t->size / sizeof(Elf_Sym))
+      return 0;
+
+   const Elf_Sym *symbol = t->table + symIndex;
+   return symbol->st_shndx != SHN_UNDEF && strcmp(t->strings + symbol->st_name, symbolName) == 0;
+}
+
+static Elf_Addr searchHashedSymbol(const mxSymTab_t *t, const char *symbolName)
+{
+   // Exact lookup of a (mangled) name through the hash sections of a dynamic symbol table
+   if (t->gnuHash)
+   {
+      const Elf_Word *h = t->gnuHash;
+      Elf_Word nBuckets = h[0];
+      Elf_Word symOffset = h[1];
+      Elf_Word bloomSize = h[2];
+      Elf_Word bloomShift = h[3];
+      const Elf_Addr *bloom = reinterpret_cast<const Elf_Addr *>(h + 4);
+      const Elf_Word *buckets = reinterpret_cast<const Elf_Word *>(bloom + bloomSize);
+      const Elf_Word *chain = buckets + nBuckets;
+      const unsigned int bits = sizeof(Elf_Addr) * 8;
+
+      if (!nBuckets || !bloomSize)
+         return 0;
+
+      Elf_Word hash = gnuHashName(symbolName);
+      Elf_Addr word = bloom[(hash / bits) % bloomSize];
+      Elf_Addr mask = ((Elf_Addr) 1 << (hash % bits)) | ((Elf_Addr) 1 << ((hash >> bloomShift) % bits));
+      if ((word & mask) != mask)
+         return 0;
+
+      Elf_Word symIndex = buckets[hash % nBuckets];
+      if (symIndex < symOffset)
+         return 0;
+
+      for (; symIndex < t->size / sizeof(Elf_Sym); symIndex++)
+      {
+         Elf_Word chainHash = chain[symIndex - symOffset];
+         if ((chainHash | 1) == (hash | 1) && isDefinedSymbol(t, symIndex, symbolName))
+            return t->baseAddr + t->table[symIndex].st_value;
+         if (chainHash & 1)
+            break;
+      }
+      return 0;
+   }
+
+   if (t->sysvHash)
+   {
+      const Elf_Word *h = t->sysvHash;
+      Elf_Word nBuckets = h[0];
+      Elf_Word nChain = h[1];
+      const Elf_Word *buckets = h + 2;
+      const Elf_Word *chain = buckets + nBuckets;
+
+      if (!nBuckets)
+         return 0;
+
+      // Bound the walk in case the chain is corrupt
+      Elf_Word symIndex = buckets[sysvHashName(symbolName) % nBuckets];
+      for (Elf_Word n = 0; symIndex != STN_UNDEF && symIndex < nChain && n < nChain; symIndex = chain[symIndex], n++)
+      {
+         if (isDefinedSymbol(t, symIndex, symbolName))
+            return t->baseAddr + t->table[symIndex].st_value;
+      }
+   }
+
+   return 0;
+}
+
+static void freeNameIndex(mxNameIndex_t *index)
+{
+   free(index->entry);
+   freeArena(&index->names);
+   index->entry = NULL;
+   index->mask = 0;
+   index->nNames = 0;
+   index->nIndexedSymtabs = 0;
+}
+
+static mxNameEntry_t *findNameEntry(const mxNameIndex_t *index, const char *name)
+{
+   // Returns the entry for name, or the empty entry where it would go
+   unsigned int slot = gnuHashName(name) & index->mask;
+   while (index->entry[slot].name && strcmp(index->entry[slot].name, name))
+      slot = (slot + 1) & index->mask;
+   return index->entry + slot;
+}
+
+static void growNameIndex(mxNameIndex_t *index, unsigned int nNames)
+{
+   // Keeps the index at most half full for nNames, rehashing the names already in it
+   unsigned int nEntries = index->entry ? index->mask + 1 : 1024;
+   while (nEntries < 2 * nNames)
+      nEntries *= 2;
+   if (index->entry && nEntries == index->mask + 1)
+      return;
+
+   mxNameEntry_t *old = index->entry;
+   unsigned int nOld = old ? index->mask + 1 : 0;
+   index->mask = nEntries - 1;
+   index->entry = static_cast<mxNameEntry_t *>(calloc(nEntries, sizeof(mxNameEntry_t)));
+
+   for (unsigned int i = 0; i < nOld; i++)
+   {
+      if (old[i].name)
+         *findNameEntry(index, old[i].name) = old[i];
+   }
+   free(old);
+}
+
+static void extendNameIndex(const mxProc *c, mxNameIndex_t *index)
+{
+   // Adds every defined symbol of the tables loaded since the last call, by its demangled name with the
+   // arguments stripped off.  The first table and symbol with a name wins, as with the old linear search.
+   if (index->nIndexedSymtabs > c->nsymtabs)
+      freeNameIndex(index);
+
+   unsigned int nSymbols = index->nNames;
+   for (int t = index->nIndexedSymtabs; t < c->nsymtabs; t++)
+      nSymbols += c->symtab[t].size / sizeof(Elf_Sym);
+   growNameIndex(index, nSymbols);
+
+   char demangled[10240];
+   int nDemangled = 0;
+
+   for (int t = index->nIndexedSymtabs; t < c->nsymtabs; t++)
+   {
+      const mxSymTab_t *table = c->symtab + t;
+      int items = table->size / sizeof(Elf_Sym);
+
+      for (int i = 0; i < items; i++)
+      {
+         const Elf_Sym *symbol = table->table + i;
+         const char *name = table->strings + symbol->st_name;
+         if (!name[0] || symbol->st_shndx == SHN_UNDEF)
+            continue;
+
+         // Only C++ names need demangling.  Anything else demangles to itself.
+         if (strncmp(name, "_Z", 2) == 0 || strncmp(name, "__1c", 4) == 0)
+         {
+            demangleSymbolName(name, demangled, sizeof(demangled));
+            char *firstpar = strchr(demangled, '(');
+            if (firstpar)
+               firstpar[0] = '\0';
+            name = demangled;
+            nDemangled++;
          }
+
+         mxNameEntry_t *entry = findNameEntry(index, name);
+         if (entry->name)
+            continue;
+
+         entry->name = name == demangled ? arenaStrdup(&index->names, name) : name;
+         entry->addr = table->baseAddr + symbol->st_value;
+         entry->symtab = t;
+         index->nNames++;
       }
    }
 
-   return 0;
+   debug("Indexed symbol tables %d to %d, %d names demangled, %u names in all", index->nIndexedSymtabs, c->nsymtabs - 1,
+         nDemangled, index->nNames);
+   index->nIndexedSymtabs = c->nsymtabs;
 }
 
 static Elf_Addr searchSymbolTable(const mxSymTab_t * t, const char *symbolName)
 {
+   // Linear search by demangled name.  Only names containing symbolName can match, so few are demangled.
    const Elf_Sym *symbol = t->table;
    int items = t->size / sizeof(Elf_Sym);
-   int i = 0;
    char demangled[10240];
 
-   for (i = 0; i < items; i++, symbol++)
+   for (int i = 0; i < items; i++, symbol++)
    {
       const char *mangled = t->strings + symbol->st_name;
 
-      if (! strstr(mangled, symbolName))
+      if (symbol->st_shndx == SHN_UNDEF || ! strstr(mangled, symbolName))
          continue;
 
-      demangleSymbolName(t->strings + symbol->st_name, demangled, sizeof(demangled));
+      demangleSymbolName(mangled, demangled, sizeof(demangled));
 
       // Strip off arguments
-      char *firstpar = strstr(demangled,"(");
+      char *firstpar = strchr(demangled, '(');
       if (firstpar)
-         firstpar[0]='\0';
+         firstpar[0] = '\0';
 
-      if (strcmp(demangled, symbolName)==0)
-      {
-         //debug("Found Symbol [%s] as item %d with value " FMT_ADR " in table with offset " FMT_ADR, symbolName, i,            symbol->st_value,t->baseAddr);
+      if (strcmp(demangled, symbolName) == 0)
          return t->baseAddr + symbol->st_value;
-      }
    }
 
    return 0;
 }
 
-const char *getUnknownSymbol()
+Elf_Addr getSymbolAddress(const mxProc * c, const char *symbolName)
 {
-   return unknownSymbol;
+   // As with the old linear search, the match from the first symbol table wins, so a symbol in the
+   // binary's .symtab is preferred to one exported by a library.
+   int i;
+
+   // Exact matches of the symbol name can be found through the hash sections of dynamic symbol tables
+   Elf_Addr hashedAddress = 0;
+   for (i = 0; i < c->nsymtabs; i++)
+   {
+      hashedAddress = searchHashedSymbol(c->symtab + i, symbolName);
+      if (hashedAddress)
+      {
+         debug("Found Symbol [%s] through hash of symbol table %d at " FMT_ADR, symbolName, i, hashedAddress);
+         break;
+      }
+   }
+
+   // Nothing comes before the first table
+   if (hashedAddress && i == 0)
+      return hashedAddress;
+
+   // Unqualified names appear in the mangled names that can match them, so the tables before the hashed
+   // match are searched as they always were.  Qualified names don't, and need the demangled name index.
+   if (!strstr(symbolName, "::"))
+   {
+      for (int t = 0; t < i; t++)
+      {
+         Elf_Addr symbolAddress = searchSymbolTable(c->symtab + t, symbolName);
+         if (symbolAddress)
+            return symbolAddress;
+      }
+      return hashedAddress;
+   }
+
+   mxNameIndex_t *index = c->nameIndex;
+   Elf_Addr symbolAddress = hashedAddress;
+
+   pthread_mutex_lock(&cacheMutex);
+   if (index->nIndexedSymtabs != c->nsymtabs)
+      extendNameIndex(c, index);
+
+   const mxNameEntry_t *entry = findNameEntry(index, symbolName);
+   if (entry->name && (!hashedAddress || entry->symtab < i))
+      symbolAddress = entry->addr;
+   pthread_mutex_unlock(&cacheMutex);
+
+   return symbolAddress;
 }
 
-static const char *getSymbolName(const mxProc * c, Elf_Addr vmAddr, Elf_Off * offset)
+static unsigned int hashPointer(const void *ptr)
 {
-   int i;
+   unsigned long h = (unsigned long) ptr;
+   h ^= h >> 16;
+   h *= 0x45d9f3b;
+   h ^= h >> 16;
+   return h;
+}
 
-   *offset = 0;
-   const char *symbolName = NULL;
+static void freeDemangleCache(mxDemangleCache_t *cache)
+{
+   debug("Demangle cache: %lu hits, %lu misses", cache->hits, cache->misses);
+   free(cache->entry);
+   free(cache->types);
+   freeArena(&cache->names);
+   memset(cache, 0, sizeof(mxDemangleCache_t));
+}
 
-   for (i = 0; i < c->nsymtabs; i++)
+static mxDemangleEntry_t *getDemangleEntry(const mxProc *p, const char *symbolName)
+{
+   // The returned entry is only valid until the next symbol is added.  The caller holds cacheMutex.
+   mxDemangleCache_t *cache = p->demangleCache;
+
+   if (cache->entry)
    {
-      symbolName = searchSymbolTable(c->symtab + i, vmAddr, offset);
-      if (symbolName && symbolName[0])
-         return symbolName;
+      unsigned int slot = hashPointer(symbolName) & cache->mask;
+      while (cache->entry[slot].symbol)
+      {
+         if (cache->entry[slot].symbol == symbolName)
+         {
+            cache->hits++;
+            return cache->entry + slot;
+         }
+         slot = (slot + 1) & cache->mask;
+      }
    }
 
-   return getUnknownSymbol();
+   cache->misses++;
+
+   // Keep the table at most half full
+   if (2 * (cache->n + 1) > cache->mask + 1)
+   {
+      unsigned int nEntries = cache->entry ? 2 * (cache->mask + 1) : 1024;
+      mxDemangleEntry_t *entry = static_cast<mxDemangleEntry_t *>(calloc(nEntries, sizeof(mxDemangleEntry_t)));
+
+      for (unsigned int i = 0; cache->entry && i <= cache->mask; i++)
+      {
+         if (!cache->entry[i].symbol)
+            continue;
+
+         unsigned int slot = hashPointer(cache->entry[i].symbol) & (nEntries - 1);
+         while (entry[slot].symbol)
+            slot = (slot + 1) & (nEntries - 1);
+         entry[slot] = cache->entry[i];
+      }
+
+      free(cache->entry);
+      cache->entry = entry;
+      cache->mask = nEntries - 1;
+   }
+
+   char demangled[10240];
+   demangleSymbolName(symbolName, demangled, sizeof(demangled));
+
+   unsigned int slot = hashPointer(symbolName) & cache->mask;
+   while (cache->entry[slot].symbol)
+      slot = (slot + 1) & cache->mask;
+
+   cache->entry[slot].symbol = symbolName;
+   cache->entry[slot].demangled = strcmp(demangled, symbolName) ? arenaStrdup(&cache->names, demangled) : symbolName;
+   cache->entry[slot].prototype = NULL;
+   cache->n++;
+
+   return cache->entry + slot;
 }
 
-static const char *getFileName(const mxProc *c, Elf_Addr vmAddr)
+const char *getDemangledName(const mxProc *p, const char *symbolName)
 {
-   Elf_Addr fileAddr = 0;
-   int elfFile = 0;
-   //Search the core last, as sometimes the binary code is there.  We are interested in the originating file
-   getFileAddrFromCore(c, vmAddr, &fileAddr, &elfFile, CORELAST);
-   return c->elfFile[elfFile].fileName;
+   // Demangles a symbol name, caching the result.  symbolName must be a name from a symbol table (or the
+   // unknown symbol), as the cache is keyed by its address.  The result is valid until the mxProc is closed.
+   if (symbolName == getUnknownSymbol())
+      return symbolName;
+
+   pthread_mutex_lock(&cacheMutex);
+   const char *demangled = getDemangleEntry(p, symbolName)->demangled;
+   pthread_mutex_unlock(&cacheMutex);
+   return demangled;
 }
 
+int getCachedPrologue(const mxProc *p, Elf_Addr function, mxPrologue_t *prologue)
+{
+   // Copies the cached prologue of function, if any.  Returns 0 if found.
+   const mxPrologueCache_t *cache = p->prologueCache;
+   int result = 1;
 
-Elf_Addr getSymbolAddress(const mxProc * c, const char *symbolName)
+   pthread_mutex_lock(&cacheMutex);
+   if (cache->entry)
+   {
+      unsigned int slot = hashPointer(reinterpret_cast<const void *>(function)) & cache->mask;
+      while (cache->entry[slot].function)
+      {
+         if (cache->entry[slot].function == function)
+         {
+            *prologue = cache->entry[slot];
+            result = 0;
+            break;
+         }
+         slot = (slot + 1) & cache->mask;
+      }
+   }
+   pthread_mutex_unlock(&cacheMutex);
+
+   return result;
+}
+
+void cachePrologue(const mxProc *p, const mxPrologue_t *prologue)
 {
-   int i;
+   mxPrologueCache_t *cache = p->prologueCache;
 
-   Elf_Addr symbolAddress = 0;
+   pthread_mutex_lock(&cacheMutex);
 
-   for (i = 0; i < c->nsymtabs; i++)
+   // Keep the table at most half full
+   if (2 * (cache->n + 1) > cache->mask + 1)
    {
-      //debug("Testing symbol table %d with offset " FMT_ADR, i, c->symtab[i].baseAddr);
-      symbolAddress = searchSymbolTable(c->symtab + i, symbolName);
-      if (symbolAddress)
-         return symbolAddress;
+      unsigned int nEntries = cache->entry ? 2 * (cache->mask + 1) : 256;
+      mxPrologue_t *entry = static_cast<mxPrologue_t *>(calloc(nEntries, sizeof(mxPrologue_t)));
+
+      for (unsigned int i = 0; cache->entry && i <= cache->mask; i++)
+      {
+         if (!cache->entry[i].function)
+            continue;
+
+         unsigned int slot = hashPointer(reinterpret_cast<const void *>(cache->entry[i].function)) & (nEntries - 1);
+         while (entry[slot].function)
+            slot = (slot + 1) & (nEntries - 1);
+         entry[slot] = cache->entry[i];
+      }
+
+      free(cache->entry);
+      cache->entry = entry;
+      cache->mask = nEntries - 1;
    }
 
-   return 0;
+   unsigned int slot = hashPointer(reinterpret_cast<const void *>(prologue->function)) & cache->mask;
+   while (cache->entry[slot].function && cache->entry[slot].function != prologue->function)
+      slot = (slot + 1) & cache->mask;
+
+   if (!cache->entry[slot].function)
+      cache->n++;
+   cache->entry[slot] = *prologue;
+   pthread_mutex_unlock(&cacheMutex);
 }
 
 static const char *anonNamespace = "(anonymous namespace)";
@@ -888,15 +2656,15 @@ char *get_short_function_name(char *name)
    return c;
 }
 
-char *get_function_name_from_prototype(char *name)
+char *get_function_name_from_prototype(const char *name)
 {
    // determine the name of the function by finding the first '('
    // character, (except if it is '(anonymous namespace)'
    // and then scan backwards until we reach either a space
    // or the start of the string or *
    char * result= (char *) malloc(strlen(name) + 1);
-   char * parenthesis;
-   char * w;
+   const char * parenthesis;
+   const char * w;
 
    parenthesis = strchr(name, '(');
 
@@ -923,46 +2691,48 @@ char *get_function_name_from_prototype(char *name)
    return result;
 }
 
-int adjustArgsForCppMethod(char *name, mxArguments *args)
+static const char *internType(mxDemangleCache_t *cache, const char *type)
 {
-   char *functionName = get_function_name_from_prototype(name);
-   if (strstr(functionName,"::"))
+   // Keep the table at most half full
+   if (2 * (cache->nTypes + 1) > cache->typeMask + 1)
    {
-      // Shift all arguments forward by 1 to allow for 'this'
-      for (int i=args->count; i>0; i--)
-         args->arg[i].type = args->arg[i-1].type;
-      args->count++;
+      unsigned int nEntries = cache->types ? 2 * (cache->typeMask + 1) : 256;
+      const char **types = static_cast<const char **>(calloc(nEntries, sizeof(const char *)));
 
-      // This is a C++ class method.  Strip off the method and add the class name as the first argument as a class pointer
-      for (char *p = functionName + strlen(functionName); p > functionName; p--)
+      for (unsigned int i = 0; cache->types && i <= cache->typeMask; i++)
       {
-         if (strstr(p,"::"))
-         {
-            *(p++)='*';
-            *p='\0';
-            break;
-         }
+         if (!cache->types[i])
+            continue;
+
+         unsigned int slot = gnuHashName(cache->types[i]) & (nEntries - 1);
+         while (types[slot])
+            slot = (slot + 1) & (nEntries - 1);
+         types[slot] = cache->types[i];
       }
-      debug("adding arg 0 as C++ class %s", functionName);
-      args->arg[0].type=functionName;
-      return 1;
+
+      free(cache->types);
+      cache->types = types;
+      cache->typeMask = nEntries - 1;
    }
-   else
+
+   unsigned int slot = gnuHashName(type) & cache->typeMask;
+   while (cache->types[slot])
    {
-      free(functionName);
-      return 0;
+      if (strcmp(cache->types[slot], type) == 0)
+         return cache->types[slot];
+      slot = (slot + 1) & cache->typeMask;
    }
+
+   cache->types[slot] = arenaStrdup(&cache->names, type);
+   cache->nTypes++;
+   return cache->types[slot];
 }
 
-int get_arg_types_from_prototype(char *name, mxArguments *args)
+static void parseArgTypes(mxDemangleCache_t *cache, const char *name, mxPrototype_t *prototype)
 {
-   // No point trying if we don't have a symbol
-   if (name == getUnknownSymbol())
-      return 0;
-
    debug("getting args from: %s", name );
 
-   char *w = strchr(name, '(');
+   const char *w = strchr(name, '(');
 
    // Ignore anonNamespace
    if (w && strncmp(w,anonNamespace,strlen(anonNamespace))==0)
@@ -971,31 +2741,27 @@ int get_arg_types_from_prototype(char *name, mxArguments *args)
    if (!w)
    {
       debug("could not find args in : %s", name);
-      return 0;
+      return;
    }
 
-   debug("found args in : %s", name);
-
+   const char *types[MAX_ARGS];
+   char *type = static_cast<char *>(malloc(strlen(name) + 1));
    int arg_index = 0;
 
    w++; // skip '('
    int level = 0;
    while (*w && *w != ')')
    {
-      args->arg[arg_index].type = (char *) calloc(strlen(name), sizeof(char));
-      char *arg_ptr = args->arg[arg_index].type;
-      debug("starting arg %d", arg_index);
+      char *arg_ptr = type;
       while(*w && ((level > 0) || (*w != ')' && *w != ',')))
       {
          if (*w == '(' || *w == '<')
          {
             level ++;
-            debug("getting deeper %d", level);
          }
          else if (*w == ')' || *w == '>')
          {
             level --;
-            debug("going up %d", level);
          }
          else if (*w == ' ') // Exclude spaces
          {
@@ -1011,17 +2777,85 @@ int get_arg_types_from_prototype(char *name, mxArguments *args)
          *(arg_ptr++) = *(w++);
       }
       *(arg_ptr++) = '\0';
-      debug("got arg %s", args->arg[arg_index].type);
+      debug("got arg %s", type);
+
+      // Leave room for 'this'
+      if (arg_index < MAX_ARGS - 1)
+         types[arg_index] = internType(cache, type);
+
       if (*w == ',' || *w == ')')
       {
          arg_index++;
          w++;
       }
+   }
 
+   free(type);
+
+   prototype->foundArguments = 1;
+   prototype->nArgs = arg_index < MAX_ARGS - 1 ? arg_index : MAX_ARGS - 1;
+   prototype->argTypes = static_cast<const char **>(arenaAlloc(&cache->names, prototype->nArgs * sizeof(const char *)));
+   memcpy(prototype->argTypes, types, prototype->nArgs * sizeof(const char *));
+}
+
+const mxPrototype_t *getPrototype(const mxProc *p, const char *symbolName)
+{
+   // Parses the demangled prototype of a symbol, caching the result.  The same rules as getDemangledName() apply.
+   if (symbolName == getUnknownSymbol())
+      return NULL;
+
+   pthread_mutex_lock(&cacheMutex);
+   mxDemangleEntry_t *entry = getDemangleEntry(p, symbolName);
+   if (entry->prototype)
+   {
+      pthread_mutex_unlock(&cacheMutex);
+      return entry->prototype;
+   }
+
+   mxDemangleCache_t *cache = p->demangleCache;
+   mxPrototype_t *prototype = static_cast<mxPrototype_t *>(arenaAlloc(&cache->names, sizeof(mxPrototype_t)));
+   memset(prototype, 0, sizeof(mxPrototype_t));
+
+   char *functionName = get_function_name_from_prototype(entry->demangled);
+   prototype->functionName = arenaStrdup(&cache->names, functionName);
+   prototype->shortFunctionName = get_short_function_name(const_cast<char *>(prototype->functionName));
+   prototype->isOperator = !strncmp(prototype->shortFunctionName,"operator",8);
+
+   if (strstr(functionName,"::"))
+   {
+      // A C++ class method would have the class name as the first argument, as a class pointer
+      for (char *c = functionName + strlen(functionName); c > functionName; c--)
+      {
+         if (strstr(c,"::"))
+         {
+            *(c++)='*';
+            *c='\0';
+            break;
+         }
+      }
+      prototype->thisType = internType(cache, functionName);
    }
+   free(functionName);
+
+   parseArgTypes(cache, entry->demangled, prototype);
+
+   entry->prototype = prototype;
+   pthread_mutex_unlock(&cacheMutex);
+   return prototype;
+}
+
+static int adjustArgsForCppMethod(const mxPrototype_t *prototype, mxArguments *args)
+{
+   if (!prototype->thisType)
+      return 0;
 
-   args->count=arg_index;
+   // Shift all arguments forward by 1 to allow for 'this'
+   for (int i=args->count; i>0; i--)
+      args->arg[i].type = args->arg[i-1].type;
+   args->count++;
 
+   debug("adding arg 0 as C++ class %s", prototype->thisType);
+   args->arg[0].type=prototype->thisType;
    return 1;
 }
 
@@ -1092,13 +2926,27 @@ void getInstrumentedArguments(const mxProc *proc, Elf_Addr frameAddr, int verbos
 #endif
 }
 
+const char *getFunctionName(const mxProc * p, Elf_Addr addr)
+{
+   // The name of the function containing addr, without its arguments
+   Elf_Off symbolOffset = 0;
+   const char *symbolName = getSymbolName(p, addr, &symbolOffset);
+
+   if (symbolName == getUnknownSymbol())
+      return symbolName;
+
+   return getPrototype(p, symbolName)->functionName;
+}
+
 void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int fullStack, int stackArguments)
 {
    debug(KGRN " ============ frameAddr : " FMT_ADR " addr : " FMT_ADR " ===================" KNRM, frameAddr, addr);
-   char demangled[10240] = "";
+   const char *demangled = getUnknownSymbol();
    Elf_Off symbolOffset = 0;
-   char *functionName = NULL;
+   const char *functionName = NULL;
+   const mxPrototype_t *prototype = NULL;
    int cppMethod=0;
+   FILE *out = getOutputFile();
    int foundArguments=0;
    char symbolType='U'; // 'U'nknown
    // 'F'unction (includes static method)
@@ -1106,19 +2954,14 @@ void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int ful
 
    const char *symbolName = getSymbolName(p, addr, &symbolOffset);
 
-   if (symbolName == getUnknownSymbol())
-   {
-      strncpy(demangled, symbolName, sizeof(demangled));
-   }
-   else
+   if (symbolName != getUnknownSymbol())
    {
-      demangleSymbolName(symbolName, demangled, sizeof(demangled));
-      functionName = get_function_name_from_prototype(demangled);
-
-      char * shortFunctionName = get_short_function_name(functionName);
+      demangled = getDemangledName(p, symbolName);
+      prototype = getPrototype(p, symbolName);
+      functionName = prototype->functionName;
 
       // operators are methods
-      if (symbolType=='U' && !strncmp(shortFunctionName,"operator",8))
+      if (symbolType=='U' && prototype->isOperator)
       {
          symbolType='M';
       }
@@ -1139,10 +2982,24 @@ void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int ful
    // Get instrumented arguments
    getInstrumentedArguments(p,frameAddr,0,args);
 
+   // Room for the merged arguments, plus 'this' and the zeroed end marker
+   int maxMerged = args->intCount + args->floatCount;
+   if (stackArguments > 0)
+      maxMerged += args->stackCount < stackArguments ? args->stackCount : stackArguments;
+   if (prototype && prototype->nArgs > maxMerged)
+      maxMerged = prototype->nArgs;
+   reserveArguments(&args->arg, &args->maxArgs, maxMerged + 2);
+
    // Get Argument types from demangled prototype.  These are loaded into args->arg[]
    if (symbolName != getUnknownSymbol())
    {
-      foundArguments = get_arg_types_from_prototype(demangled, args);
+      foundArguments = prototype->foundArguments;
+      if (foundArguments)
+      {
+         for (int i = 0; i < prototype->nArgs; i++)
+            args->arg[i].type = prototype->argTypes[i];
+         args->count = prototype->nArgs;
+      }
 
       // If we are a C++ method, we need an extra argument for 'this'
       if (symbolType == 'U' && args->intCount >= maxInt )
@@ -1150,7 +3007,7 @@ void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int ful
          // If we have 6 or more arguments intCount is probably inaccurate as we will either be
          // 32bit where we just read a block of 8 arguments, or we are 64bit with extra args passed on the stack
          // We will assume we are a method and print a warning
-         cppMethod=adjustArgsForCppMethod(demangled, args);
+         cppMethod=adjustArgsForCppMethod(prototype, args);
 
          if (cppMethod && fullStack)
             warning("Assuming %s is a C++ method. If this is incorrect, arguments will be offset by 1.", functionName);
@@ -1160,7 +3017,7 @@ void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int ful
       else if (symbolType == 'M' ||
                (symbolType == 'U' && foundArguments && (args->intCount + args->floatCount) == (args->count + 1)))
       {
-         cppMethod=adjustArgsForCppMethod(demangled, args);
+         cppMethod=adjustArgsForCppMethod(prototype, args);
       }
    }
 
@@ -1292,7 +3149,7 @@ void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int ful
       {
          args->arg[i].size = args->intArg[iInt].size;
          args->arg[i].val = args->intArg[iInt].val;
-         args->arg[i].type = strdup(getUnknownSymbol());
+         args->arg[i].type = getUnknownSymbol();
          i++;
       }
 
@@ -1300,7 +3157,7 @@ void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int ful
       {
          args->arg[i].size = args->floatArg[iFloat].size;
          args->arg[i].val = args->floatArg[iFloat].val;
-         args->arg[i].type = strdup(getUnknownSymbol());
+         args->arg[i].type = getUnknownSymbol();
          i++;
       }
 
@@ -1310,7 +3167,7 @@ void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int ful
          {
             args->arg[i].size = args->stackArg[iStack].size;
             args->arg[i].val = args->stackArg[iStack].val;
-            args->arg[i].type = strdup(getUnknownSymbol());
+            args->arg[i].type = getUnknownSymbol();
             i++;
          }
       }
@@ -1320,48 +3177,48 @@ void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int ful
 
    if (fullStack)
    {
-      printf(FMT_ADR " %s(", (unsigned long) addr, demangled);
+      fprintf(out, FMT_ADR " %s(", (unsigned long) addr, demangled);
 
       for (int i = 0; i < args->count; i++)
       {
          if (cppMethod && i==0)
-            printf("this=");
+            fprintf(out, "this=");
 
          if (args->arg[i].size == 0)
          {
-            printf("<unknown>");
+            fprintf(out, "<unknown>");
          }
          else if (strcmp(args->arg[i].type,"double")==0)
          {
-            printf("%lf", args->arg[i].val.valDouble);
+            fprintf(out, "%lf", args->arg[i].val.valDouble);
          }
          else if (strcmp(args->arg[i].type,"longdouble")==0)
          {
-            printf("%Lf", args->arg[i].val.valLongDouble);
+            fprintf(out, "%Lf", args->arg[i].val.valLongDouble);
          }
          else if (strcmp(args->arg[i].type,"float")==0)
          {
-            printf("%f", (float)args->arg[i].val.valFloat);
+            fprintf(out, "%f", (float)args->arg[i].val.valFloat);
          }
          else
          {
             switch (args->arg[i].size)
             {
-               case 16: printf("%#Lf", args->arg[i].val.valLongDouble); break;
-               case 8: printf("%#lx", args->arg[i].val.val); break;
-               case 4: printf("%#x",  args->arg[i].val.val4); break;
-               case 2: printf("%#hx",  args->arg[i].val.val4); break;
-               case 1: printf("%#hhx", args->arg[i].val.val1); break;
+               case 16: fprintf(out, "%#Lf", args->arg[i].val.valLongDouble); break;
+               case 8: fprintf(out, "%#lx", args->arg[i].val.val); break;
+               case 4: fprintf(out, "%#x",  args->arg[i].val.val4); break;
+               case 2: fprintf(out, "%#hx",  args->arg[i].val.val4); break;
+               case 1: fprintf(out, "%#hhx", args->arg[i].val.val1); break;
             }
          }
 
          if (cppMethod && i==0)
-            printf("; ");
+            fprintf(out, "; ");
          else if (i != args->count - 1)
-            printf(", ");
+            fprintf(out, ", ");
       }
 
-      printf(") + %#lx [%s]\n", (unsigned long) symbolOffset, getFileName(p,addr));
+      fprintf(out, ") + %#lx [%s]\n", (unsigned long) symbolOffset, getFileName(p,addr));
    }
 
 
@@ -1369,19 +3226,56 @@ void printStackItem(const mxProc * p, Elf_Addr addr, Elf_Addr frameAddr, int ful
    if (symbolName != getUnknownSymbol())
       display_arguments(p, functionName, args);
 
-   if (functionName)
-      free(functionName);
+   releaseArguments();
+}
 
-   for (int i=0; i <args->count; i++)
-      free(args->arg[i].type);
+// Handles both PID & Cores
+typedef struct
+{
+   int fullStack;
+   int stackArguments;
+} mxPrintFrameArgs_t;
 
-   free(args);
+static int printFrame(const mxProc *p, Elf_Addr addr, Elf_Addr frameAddr, void *arg)
+{
+   const mxPrintFrameArgs_t *print = static_cast<const mxPrintFrameArgs_t *>(arg);
+   printStackItem(p, addr, frameAddr, print->fullStack, print->stackArguments);
+   return 0;
+}
+
+void printCallStack(const mxProc * p, mxLWP_t t, int fullStack, int stackArguments, int corruptStackSearch)
+{
+   mxPrintFrameArgs_t print = {fullStack, stackArguments};
+   walkCallStack(p, t, fullStack, 0, corruptStackSearch, printFrame, &print);
+}
+
+typedef struct
+{
+   Elf_Addr *frames;
+   int nFrames;
+   int maxFrames;
+} mxFrameList_t;
+
+static int collectFrame(const mxProc *p, Elf_Addr addr, Elf_Addr frameAddr, void *arg)
+{
+   mxFrameList_t *list = static_cast<mxFrameList_t *>(arg);
+   list->frames[list->nFrames++] = addr;
+   return list->nFrames == list->maxFrames;
+}
+
+int getCallStack(const mxProc *p, mxLWP_t t, int corruptStackSearch, Elf_Addr *frames, int maxFrames)
+{
+   // Walks the stack of t without printing anything, returning up to maxFrames return addresses
+   mxFrameList_t list = {frames, 0, maxFrames};
+   if (maxFrames > 0)
+      walkCallStack(p, t, 0, 1, corruptStackSearch, collectFrame, &list);
+   return list.nFrames;
 }
 
-// Handles both PID & Cores
 void closeMxProc(mxProc * p)
 {
    // Close and unmm all symtable files
+   unmapFileWindows(p);
 
    while (p->elfOpen)
    {
@@ -1394,32 +3288,48 @@ void closeMxProc(mxProc * p)
       closeMxProcPID(p);
    }
 
+   freeMemorySnapshot(p);
+   freeSegmentIndex(p);
+   freeSymbolIndex(p);
+   free(p->elfFile);
+   free(p->symtab);
+   free(p->LWPs);
+   freeNameIndex(p->nameIndex);
+   free(p->nameIndex);
+   freeDemangleCache(p->demangleCache);
+   free(p->demangleCache);
+   debug("Prologue cache: %u functions", p->prologueCache->n);
+   free(p->prologueCache->entry);
+   free(p->prologueCache);
+   freePageCache(p->pageCache);
    free(p);
 }
 
 void dumpStack(const mxProc * p, mxLWP_t t, int words)
 {
+   FILE *out = getOutputFile();
    size_t bias = 0;
 #if (defined(__sparc) && defined (_LP64))
    bias = 0x7ff;
 #endif
 
-   printf("Dumping Stack sp:" FMT_ADR " fp:" FMT_ADR " ip:" FMT_ADR " stack:" FMT_ADR " size:" FMT_ADR "\n", (unsigned long) t.sp, (unsigned long) t.fp, (unsigned long) t.ip,
+   fprintf(out, "Dumping Stack sp:" FMT_ADR " fp:" FMT_ADR " ip:" FMT_ADR " stack:" FMT_ADR " size:" FMT_ADR "\n", (unsigned long) t.sp, (unsigned long) t.fp, (unsigned long) t.ip,
           (unsigned long) t.stack, (unsigned long) t.stacksize);
 
    if (bias)
    {
       t.sp+=bias;
       t.fp+=bias;
-      printf("Applying stack bias:" FMT_ADR " New sp: " FMT_ADR " New fp: " FMT_ADR "\n", (unsigned long)bias, (unsigned long) t.sp, (unsigned long) t.fp);
+      fprintf(out, "Applying stack bias:" FMT_ADR " New sp: " FMT_ADR " New fp: " FMT_ADR "\n", (unsigned long)bias, (unsigned long) t.sp, (unsigned long) t.fp);
    }
 
    Elf_Addr currentValue;
    size_t i = 0;
    size_t maxSize = t.stack ? t.stacksize / sizeof(void*) : words;
-   char demangled[10240];
+   const char *demangled;
    Elf_Addr nextFrame=t.fp;
    debug("Printing %ld words of stack",maxSize);
+   adviseMxProcVM(p, t.sp, maxSize * sizeof(void *));
 
 
    for (i = 0; i < maxSize; i++)
@@ -1431,21 +3341,21 @@ void dumpStack(const mxProc * p, mxLWP_t t, int words)
       Elf_Off symbolOffset = 0;
       if ((currentValue+bias) > t.sp && (currentValue+bias) < t.sp + maxSize * sizeof(void *))
       {
-         strcpy(demangled, "STACKPOINTER");
+         demangled = "STACKPOINTER";
          symbolOffset = (currentValue+bias) - t.sp;
       }
       else
       {
          const char *symbolName = getSymbolName(p, currentValue, &symbolOffset);
 
-         demangleSymbolName(symbolName, demangled, sizeof(demangled));
+         demangled = getDemangledName(p, symbolName);
       }
-      printf("%d   " FMT_ADR ": " FMT_ADR " == %s + %#lx (%ld) [%s]", (int) (i * sizeof(void *)), (unsigned long)currentAddress, (unsigned long) currentValue,
+      fprintf(out, "%d   " FMT_ADR ": " FMT_ADR " == %s + %#lx (%ld) [%s]", (int) (i * sizeof(void *)), (unsigned long)currentAddress, (unsigned long) currentValue,
              demangled, (unsigned long) symbolOffset, (unsigned long) symbolOffset, getFileName(p,currentValue));
 
       if (currentAddress == nextFrame)
       {
-         printf(" ******** FRAME ********");
+         fprintf(out, " ******** FRAME ********");
 #if !defined(__sparc)
          nextFrame=currentValue;
 #endif
@@ -1455,16 +3365,16 @@ void dumpStack(const mxProc * p, mxLWP_t t, int words)
       if (currentAddress == nextFrame + 14 * sizeof(void*))
       {
          nextFrame=currentValue+bias;
-         printf(" ******** Next Frame is " FMT_ADR " ******** ", nextFrame);
+         fprintf(out, " ******** Next Frame is " FMT_ADR " ******** ", nextFrame);
       }
 #endif
 
       if (currentValue == PMX_INSTRUMENT_START_TAG)
-         printf(" ******** INSTRUMENTATION START ********");
+         fprintf(out, " ******** INSTRUMENTATION START ********");
       else if (currentValue == PMX_INSTRUMENT_END_TAG)
-         printf(" ******** INSTRUMENTATION END ********");
+         fprintf(out, " ******** INSTRUMENTATION END ********");
 
-      printf("\n");
+      fprintf(out, "\n");
    }
 }
 
@@ -1508,55 +3418,81 @@ double read_double(const mxProc * p, Elf_Addr vmAddr)
    return ret;
 }
 
-void read_string(const mxProc * p, Elf_Addr vmAddr, char *buf, size_t buf_length)
+int readFileByVMAddress(const mxProc * p, Elf_Addr vmAddr, void *buff, size_t size, int elfFile);
+
+static int readStringSpan(const mxProc *p, Elf_Addr vmAddr, char *buf, size_t size, int elfID)
+{
+   if (elfID >= 0)
+      return readFileByVMAddress(p, vmAddr, buf, size, elfID);
+   return readMxProcVM(p, vmAddr, buf, size);
+}
+
+static size_t scanString(const mxProc *p, Elf_Addr vmAddr, char *buf, size_t size, int elfID, int *complete)
 {
+   // Reads a string from the process, or from elf file elfID if it isn't negative.  Spans end on a
+   // page boundary, and reads from files are split at segment boundaries, so a failed read means the
+   // string really runs into unreadable memory.  The first span ends at the end of a page, as most
+   // strings are short, and later ones double.
+   static const size_t pageSize = sysconf(_SC_PAGESIZE);
+   const size_t maxPages = 16;
+   size_t pages = 1;
+   size_t i = 0;
 
-   // First try reading chunks which is faster
-   size_t i=0;
-   const size_t chunkSize=1024;
-   while (buf_length - i >= chunkSize)
+   *complete = 0;
+   while (i < size)
    {
-      char c[chunkSize];
-      if (readMxProcVM(p, vmAddr+i, &c, chunkSize))
+      Elf_Addr addr = vmAddr + i;
+      size_t length = pages * pageSize - addr % pageSize;
+      if (length > size - i)
+         length = size - i;
+
+      if (readStringSpan(p, addr, buf + i, length, elfID))
       {
-         // This isn't necessarily an issue. Retry going one byte at a time.
-         break;
+         // The string may still end before the unreadable part.  Retry up to the end of the page,
+         // then a byte at a time in case a segment boundary splits the page before the index is built.
+         size_t pageLeft = pageSize - addr % pageSize;
+         if (length > pageLeft && !readStringSpan(p, addr, buf + i, pageLeft, elfID))
+            length = pageLeft;
+         else if (length > 1 && !readStringSpan(p, addr, buf + i, 1, elfID))
+            length = 1;
+         else
+         {
+            warning("Failed to read full string");
+            *complete = 1;
+            return i;
+         }
+         pages = 1;
       }
-      else
+      else if (pages < maxPages)
       {
-         memcpy(buf+i, c, chunkSize);
-
-         // If there is a null inside the chunk, stop
-         for (int j=0; j< chunkSize; j++)
-            if (c[j]=='\0')
-               return;
+         pages *= 2;
       }
 
-      i+=chunkSize;
-   }
-
-   // If we have less than one chunk to go, just iterate one byte at a time
-   for (; i<buf_length; i++)
-   {
-      char c;
-      if (readMxProcVM(p, vmAddr+i, &c, 1))
-      {
-         warning("Failed to read full string");
-         buf[i]='\0';
-         return;
-      }
-      else
+      // memchr is vectorised by libc, picking SSE2 or AVX2 at run time
+      char *nul = static_cast<char *>(memchr(buf + i, '\0', length));
+      if (nul)
       {
-         buf[i]=c;
-         if (c=='\0')
-            return;
+         *complete = 1;
+         return nul - buf;
       }
+      i += length;
    }
 
-   //Pad with null to avoid issues
-   buf[buf_length-1]='\0';
+   return i;
+}
 
-   return;
+void read_string(const mxProc * p, Elf_Addr vmAddr, char *buf, size_t buf_length)
+{
+   int complete;
+   buf[scanString(p, vmAddr, buf, buf_length - 1, -1, &complete)] = '\0';
+}
+
+// Reads at most size characters of the string at vmAddr into buf, without null terminating it.
+// Returns the number of characters read.  *complete is set once the terminating null or an
+// unreadable byte has been reached, so callers can stream a long string a piece at a time.
+size_t read_string_part(const mxProc * p, Elf_Addr vmAddr, char *buf, size_t size, int *complete)
+{
+   return scanString(p, vmAddr, buf, size, -1, complete);
 }
 
 void read_bytes(const mxProc * p, Elf_Addr vmAddr, void *buf, size_t buf_length)
@@ -1567,8 +3503,77 @@ void read_bytes(const mxProc * p, Elf_Addr vmAddr, void *buf, size_t buf_length)
    return;
 }
 
+static int readrequestcompare(const void *a, const void *b)
+{
+   const mxReadRequest *ra = *static_cast<mxReadRequest * const *>(a);
+   const mxReadRequest *rb = *static_cast<mxReadRequest * const *>(b);
+
+   if (ra->vmAddr != rb->vmAddr)
+      return ra->vmAddr < rb->vmAddr ? -1 : 1;
+   return ra < rb ? -1 : (ra > rb ? 1 : 0);
+}
+
+int readMxProcVMBatch(const mxProc * p, mxReadRequest *requests, int nRequests)
+{
+   // Reads a set of ranges, merging those that touch or overlap so each run is read with a single readMxProcVM.
+   // If a run can't be read in one go (e.g. it spans segments), its requests are read one by one.
+   // Returns the number of requests that failed.
+   if (nRequests <= 0)
+      return 0;
+
+   mxReadRequest **sorted = static_cast<mxReadRequest **>(malloc(nRequests * sizeof(mxReadRequest *)));
+   for (int i = 0; i < nRequests; i++)
+      sorted[i] = requests + i;
+   qsort(sorted, nRequests, sizeof(mxReadRequest *), readrequestcompare);
+
+   char stackBuff[1024];
+   int nFailed = 0;
+
+   for (int first = 0, last; first < nRequests; first = last)
+   {
+      Elf_Addr runStart = sorted[first]->vmAddr;
+      Elf_Addr runEnd = runStart + sorted[first]->size;
+
+      for (last = first + 1; last < nRequests && sorted[last]->vmAddr <= runEnd; last++)
+      {
+         if (sorted[last]->vmAddr + sorted[last]->size > runEnd)
+            runEnd = sorted[last]->vmAddr + sorted[last]->size;
+      }
+
+      size_t runSize = runEnd - runStart;
+      char *runBuff = NULL;
+      if (last - first > 1)
+         runBuff = runSize <= sizeof(stackBuff) ? stackBuff : static_cast<char *>(malloc(runSize));
+
+      if (runBuff && !readMxProcVM(p, runStart, runBuff, runSize))
+      {
+         for (int i = first; i < last; i++)
+         {
+            memcpy(sorted[i]->buff, runBuff + (sorted[i]->vmAddr - runStart), sorted[i]->size);
+            sorted[i]->status = 0;
+         }
+      }
+      else
+      {
+         for (int i = first; i < last; i++)
+         {
+            sorted[i]->status = readMxProcVM(p, sorted[i]->vmAddr, sorted[i]->buff, sorted[i]->size);
+            if (sorted[i]->status)
+               nFailed++;
+         }
+      }
+
+      if (runBuff != stackBuff)
+         free(runBuff);
+   }
+
+   free(sorted);
+   return nFailed;
+}
+
 void addIntArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_Addr argAddr, int argLength)
 {
+   reserveArguments(&args->intArg, &args->maxIntArgs, argNumber + 1);
    if (args->intCount < argNumber+1)
       args->intCount=argNumber+1;
 
@@ -1583,6 +3588,7 @@ void addIntArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_Ad
 
 void addStackArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_Addr argAddr, int argLength)
 {
+   reserveArguments(&args->stackArg, &args->maxStackArgs, argNumber + 1);
    if (args->stackCount < argNumber+1)
       args->stackCount=argNumber+1;
 
@@ -1595,8 +3601,39 @@ void addStackArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_
    debug("Added Stack Argument %d size %d bytes from Address " FMT_ADR " with value " FMT_ADR,argNumber,argLength,argAddr,args->stackArg[argNumber].val.val);
 }
 
+void addStackArguments(const mxProc *proc, mxArguments *args, Elf_Addr argAddr, int nArgs, int argLength)
+{
+   // Reads nArgs consecutive stack arguments starting at argAddr
+   mxReadRequest requests[MAX_ARGS];
+
+   if (nArgs > MAX_ARGS)
+      nArgs = MAX_ARGS;
+   reserveArguments(&args->stackArg, &args->maxStackArgs, nArgs);
+
+   for (int i = 0; i < nArgs; i++)
+   {
+      args->stackArg[i].size = argLength;
+      requests[i].vmAddr = argAddr + i * argLength;
+      requests[i].size = argLength;
+      requests[i].buff = &(args->stackArg[i].val.val4);
+   }
+
+   if (args->stackCount < nArgs)
+      args->stackCount = nArgs;
+
+   readMxProcVMBatch(proc, requests, nArgs);
+
+   for (int i = 0; i < nArgs; i++)
+   {
+      if (requests[i].status)
+         debug("Error reading argument %d",i);
+      debug("Added Stack Argument %d size %d bytes from Address " FMT_ADR " with value " FMT_ADR,i,argLength,requests[i].vmAddr,args->stackArg[i].val.val);
+   }
+}
+
 void addInstrumentedArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_Addr argAddr, int argLength)
 {
+   reserveArguments(&args->instArg, &args->maxInstArgs, argNumber + 1);
    if (args->instCount < argNumber+1)
       args->instCount=argNumber+1;
 
@@ -1606,11 +3643,12 @@ void addInstrumentedArgument(const mxProc *proc, mxArguments *args, int argNumbe
    {
       debug("Error reading argument %d",argNumber);
    }
-   debug("Added Instrumented Argument %d type %s size %d bytes from Address " FMT_ADR " with value " FMT_ADR,argNumber,args->arg[argNumber].type, argLength,argAddr,args->instArg[argNumber].val.val4);
+   debug("Added Instrumented Argument %d size %d bytes from Address " FMT_ADR " with value " FMT_ADR,argNumber,argLength,argAddr,args->instArg[argNumber].val.val4);
 }
 
 void addFloatArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_Addr argAddr, int argLength)
 {
+   reserveArguments(&args->floatArg, &args->maxFloatArgs, argNumber + 1);
    if (args->floatCount < argNumber+1)
       args->floatCount=argNumber+1;
 
@@ -1625,10 +3663,6 @@ void addFloatArgument(const mxProc *proc, mxArguments *args, int argNumber, Elf_
 
 void loadLibraries(mxProc * p, int elfID, const char *libraryRoot, int plddMode)
 {
-   // Make sure we don't over run the buffer
-   if (p->nsymtabs >= MAX_SYMTABS)
-      return;
-
    const char * mmFile = reinterpret_cast <const char *>(p->elfFile[elfID].mmloc);
    const Elf_Ehdr *elfHdr = reinterpret_cast < const Elf_Ehdr * >(mmFile);
    const Elf_Phdr *progHdrs = reinterpret_cast < const Elf_Phdr * >(mmFile + elfHdr->e_phoff);
@@ -1725,6 +3759,9 @@ int readFileByVMAddress(const mxProc * p, Elf_Addr vmAddr, void *buff, size_t si
 
    memset(buff, 0, size);       // Calling functions should check the return value, but in case they dont.....
 
+   if (p->nIndexedElfs && p->nIndexedElfs == p->elfOpen && elfFile >= 0 && elfFile < p->nIndexedElfs)
+      return readSegmentsVM(p, p->fileIndex + elfFile, vmAddr, static_cast<char *>(buff), size);
+
    // Find file address
    Elf_Addr fileAddr = 0;
    getFileAddrFromCore(p, vmAddr, &fileAddr, &elfFile, FILEONLY);
@@ -1763,27 +3800,8 @@ int readFileByVMAddress(const mxProc * p, Elf_Addr vmAddr, void *buff, size_t si
 
 void read_string_from_file(const mxProc * p, Elf_Addr vmAddr, char *buf, size_t buf_length, int elfID)
 {
-   // Cut down version of read_string which only reads from a particular file, and only 1 byte at a time.
-   for (size_t i=0; i<buf_length; i++)
-   {
-      char c;
-      if (readFileByVMAddress(p, vmAddr+i, &c, 1, elfID))
-      {
-         warning("Failed to read full string");
-         buf[i]='\0';
-         return;
-      }
-      else
-      {
-         buf[i]=c;
-         if (c=='\0')
-            return;
-      }
-   }
-
-   //Pad with null to avoid issues
-   buf[buf_length-1]='\0';
-
-   return;
+   // Version of read_string which only reads from a particular file
+   int complete;
+   buf[scanString(p, vmAddr, buf, buf_length - 1, elfID, &complete)] = '\0';
 }
 
@@ -29,26 +29,72 @@
 
 void readFile(const mxProc * c, int elfID, Elf_Addr fileAddr, void *buffPointer, size_t size)
 {
-   if (lseek64(c->elfFile[elfID].fd,fileAddr,SEEK_SET) != fileAddr)
+   if (!readFileMapped(c, elfID, fileAddr, buffPointer, size))
+      return;
+
+   // pread rather than lseek/read, as the fd is shared by the threads unwinding LWPs
+   if (pread64(c->elfFile[elfID].fd, buffPointer, size, fileAddr) == -1)
    {
-      fatal_error("Failed to seek offset "FMT_ADR" in file %d.",fileAddr, elfID);
+      fatal_error("Failed to read offset "FMT_ADR" in file %d.",fileAddr, elfID);
    }
-   read(c->elfFile[elfID].fd, buffPointer, size);
 }
 
-void closeMxProcPID(mxProc * p)
+void detachMxProcPID(mxProc * p)
 {
-   if (p->pid && kill(p->pid, SIGCONT) == -1)
+   // Lets the process run again.  Its address space can still be read.
+   if (!p->attached)
+      return;
+   p->attached = 0;
+   invalidatePageCache(p);
+
+   if (kill(p->pid, SIGCONT) == -1)
    {
       perror("kill: ");
       printf("Failed to send continue signal to process %ld.\n", (long) p->pid);
    }
+}
+
+static void stopProcess(mxProc * p)
+{
+   p->attached = 1;
+   if (kill(p->pid, SIGSTOP) == -1)
+   {
+      perror("kill: ");
+      fatal_error("Failed to send stop signal to process %d.", p->pid);
+   }
+}
+
+void stopMxProcPID(mxProc * p, int lwp)
+{
+   // Stops the process again after detachMxProcPID(), and reads the registers of its LWPs afresh
+   if (p->attached)
+      return;
+   invalidatePageCache(p);
+   stopProcess(p);
+
+   p->nLWPs = 0;
+   getLWPsFromPID(p, lwp);
+}
+
+long samplePerfEvents(const mxProc * p, long intervalMs, long durationMs, mxSampleCallback * callback, void *arg)
+{
+   warning("perf events are only available on Linux");
+   return -1;
+}
+
+static void freeFileMaps();
+
+void closeMxProcPID(mxProc * p)
+{
+   detachMxProcPID(p);
+   freeFileMaps();
    if (p->as)
       close(p->as);
 }
 
-void getLWPsFromPID(mxProc * p)
+void getLWPsFromPID(mxProc * p, int lwp)
 {
+   // If lwp isn't 0, only that LWP is listed
    char fileName[128];
 
    snprintf(fileName, sizeof(fileName), "/proc/%ld/lwp", (long) p->pid);
@@ -64,6 +110,9 @@ void getLWPsFromPID(mxProc * p)
       if (lwpID[0] == '.')      // . or ..
          continue;
 
+      if (lwp && atoi(lwpID) != lwp)
+         continue;
+
       snprintf(fileName, sizeof(fileName), "/proc/%ld/lwp/%s/lwpstatus", (long) p->pid, lwpID);
 
       FILE *f = fopen(fileName, "rbF");
@@ -81,7 +130,7 @@ void getLWPsFromPID(mxProc * p)
       readMxProcVM(p, (Elf_Addr) s.pr_ustack, &stackinfo, sizeof(stack_t));
 
       prgreg_t *regs = (prgreg_t *) & (s.pr_reg);
-      mxLWP_t *lwp = &(p->LWPs[p->nLWPs++]);
+      mxLWP_t *lwp = addLWP(p);
 
       lwp->lwpID = atoi(lwpID);
       lwp->fp = static_cast < Elf_Addr > (regs[R_FP]);
@@ -90,8 +139,6 @@ void getLWPsFromPID(mxProc * p)
       lwp->stack = reinterpret_cast < Elf_Addr > (stackinfo.ss_sp);
       lwp->stacksize = stackinfo.ss_size;
       free(namelist[t]);
-      if (p->nLWPs >= MAX_LWPS)
-         break;
    }
    free(namelist);
 }
@@ -135,7 +182,7 @@ void getLWPsFromCore(mxProc * c)
 
             prgreg_t *regs = (prgreg_t *) & (s.pr_reg);
 
-            mxLWP_t *lwp = &(c->LWPs[c->nLWPs++]);
+            mxLWP_t *lwp = addLWP(c);
 
             lwp->lwpID = s.pr_lwpid;
             lwp->fp = static_cast < Elf_Addr > (regs[R_FP]);
@@ -164,71 +211,132 @@ void getLWPsFromCore(mxProc * c)
          }
 
          nOff = nOff + dataSize;
-         if (c->nLWPs >= MAX_LWPS)
-            break;
       }
    }
 }
 
-int readMxProcVM(const mxProc * p, Elf_Addr vmAddr, void *buff, size_t size)
+int getVMRegionFromPID(const mxProc * p, Elf_Addr vmAddr, Elf_Addr *start, Elf_Addr *end)
 {
-   memset(buff, 0, size);       // Calling functions should check the return value, but in case they dont.....
+   // Find the mapping containing vmAddr from /proc/<pid>/map.  Returns 0 if found.
+   char fileName[128];
+   snprintf(fileName, sizeof(fileName), "/proc/%ld/map", (long) p->pid);
 
-   if (p->type == mxProcTypeCore)
-   {
-      // Find file address
-      Elf_Addr fileAddr = 0;
-      int elfFile = 0;
-      getFileAddrFromCore(p, vmAddr, &fileAddr, &elfFile, COREFIRST);
-      //debug("found file address "FMT_ADR" for "FMT_ADR,fileAddr,vmAddr);
+   int fd = open(fileName, O_RDONLY);
+   if (fd == -1)
+      return 1;
 
-      if (!fileAddr)
+   prmap_t map;
+   int notFound = 1;
+   while (notFound && read(fd, &map, sizeof(map)) == sizeof(map))
+   {
+      if (vmAddr >= (Elf_Addr) map.pr_vaddr && vmAddr < (Elf_Addr) map.pr_vaddr + map.pr_size)
       {
-         debug("Could not find vm address "FMT_ADR" in the core file.  Check pmap.", vmAddr);
-         return 1;
+         *start = (Elf_Addr) map.pr_vaddr;
+         *end = (Elf_Addr) map.pr_vaddr + map.pr_size;
+         notFound = 0;
       }
+   }
 
-      Elf_Addr endAddr = 0;
-      int endElfFile = 0;
-      getFileAddrFromCore(p, vmAddr + size - 1, &endAddr, &endElfFile, COREFIRST);
+   close(fd);
+   return notFound;
+}
 
-      if (!endAddr)
-      {
-         debug("Memory address goes beyond mapped areas (base "FMT_ADR" + size %#lx).  Check pmap.", vmAddr, size);
-         return 1;
-      }
+// isFileMappedAt() reads /proc/<pid>/map once, and stats each mapped object at most once
+static int nFileMaps = 0;
+static pid_t fileMapsPID = 0;
+static prmap_t *fileMaps = NULL;    // in address order
+static mxstat *fileMapStat = NULL;
+static signed char *fileMapStatus = NULL;   // 0 not stat'ed yet, 1 stat'ed, -1 no file
 
-      if (elfFile!=endElfFile)
+static void freeFileMaps()
+{
+   free(fileMaps);
+   free(fileMapStat);
+   free(fileMapStatus);
+   fileMaps = NULL;
+   fileMapStat = NULL;
+   fileMapStatus = NULL;
+   nFileMaps = 0;
+}
+
+static int readFileMaps(const mxProc * p)
+{
+   freeFileMaps();
+   fileMapsPID = p->pid;
+
+   char fileName[128];
+   snprintf(fileName, sizeof(fileName), "/proc/%ld/map", (long) p->pid);
+   int fd = open(fileName, O_RDONLY);
+   if (fd == -1)
+      return 1;
+
+   int maxFileMaps = 0;
+   prmap_t map;
+   while (read(fd, &map, sizeof(map)) == sizeof(map))
+   {
+      if (nFileMaps == maxFileMaps)
       {
-         debug("Memory address "FMT_ADR" goes across 2 elf files.", vmAddr);
-         return 1;
+         maxFileMaps = maxFileMaps ? 2 * maxFileMaps : 256;
+         fileMaps = static_cast<prmap_t *>(realloc(fileMaps, maxFileMaps * sizeof(prmap_t)));
       }
+      fileMaps[nFileMaps++] = map;
+   }
 
-      if (fileAddr == ADDR_NULLVALUES && endAddr == ADDR_NULLVALUES)
+   close(fd);
+   fileMapStat = static_cast<mxstat *>(malloc(nFileMaps * sizeof(mxstat)));
+   fileMapStatus = static_cast<signed char *>(calloc(nFileMaps, 1));
+   return 0;
+}
+
+int isFileMappedAt(const mxProc * p, Elf_Addr start, Elf_Addr end, const mxstat *fileStat)
+{
+   // Returns 1 if every mapping in [start, end) is of the file fileStat was taken from, with no gaps.
+   // /proc/<pid>/path only resolves the objects of mappings whose files still exist.
+   if ((!fileMaps || fileMapsPID != p->pid) && readFileMaps(p))
+      return 0;
+
+   for (Elf_Addr vmAddr = start; vmAddr < end;)
+   {
+      int lo = 0, hi = nFileMaps;
+      while (lo < hi)
       {
-         // Valid, but unused memory space.  Return null values.
-         return 0;
+         int mid = (lo + hi) / 2;
+         if ((Elf_Addr) fileMaps[mid].pr_vaddr <= vmAddr)
+            lo = mid + 1;
+         else
+            hi = mid;
       }
-      else if (fileAddr == ADDR_NULLVALUES || endAddr == ADDR_NULLVALUES)
-      {
-         warning("Reads across used/unused memory boundaries are not supported (base "FMT_ADR" + size %#lx).", vmAddr, size);
+      if (!lo || vmAddr >= (Elf_Addr) fileMaps[lo - 1].pr_vaddr + fileMaps[lo - 1].pr_size)
          return 0;
-      }
 
-      readFile(p, elfFile, fileAddr, buff, size);
-   }
-   else if (p->type == mxProcTypePID)
-   {
-      if (pread(p->as, buff, size, (Elf_Off) vmAddr) != size)
+      int i = lo - 1;
+      if (!fileMapStatus[i])
       {
-         //perror("pread: ");
-         debug("Unable to read %d bytes from location "FMT_ADR, size, vmAddr);
-         return 1;
+         char pathName[128 + PRMAPSZ];
+         snprintf(pathName, sizeof(pathName), "/proc/%ld/path/%s", (long) p->pid, fileMaps[i].pr_mapname);
+         fileMapStatus[i] = fileMaps[i].pr_mapname[0] && stat64(pathName, fileMapStat + i) == 0 ? 1 : -1;
       }
+      if (fileMapStatus[i] < 0 || fileMapStat[i].st_dev != fileStat->st_dev || fileMapStat[i].st_ino != fileStat->st_ino)
+         return 0;
+      vmAddr = (Elf_Addr) fileMaps[i].pr_vaddr + fileMaps[i].pr_size;
    }
-   else
+
+   return 1;
+}
+
+int canReadFromAnyThread(const mxProc * p)
+{
+   // /proc/<pid>/as can be read from any thread
+   return 1;
+}
+
+int readVMFromPID(const mxProc * p, Elf_Addr vmAddr, void *buff, size_t size)
+{
+   if (pread(p->as, buff, size, (Elf_Off) vmAddr) != size)
    {
-      fatal_error("Invalid MxProcType.");
+      //perror("pread: ");
+      debug("Unable to read %d bytes from location "FMT_ADR, size, vmAddr);
+      return 1;
    }
    return 0;
 }
@@ -262,7 +370,7 @@ void demangleSymbolName(const char *symbolName, char *demangled, int size)
    }
 }
 
-mxProc *openPID(const char *binFileName, const char *pid, int plddMode)
+mxProc *openPID(const char *binFileName, const char *pid, int plddMode, mxAttachMode mode, int lwp)
 {
    mxProc *p = static_cast < mxProc * >(malloc(sizeof(mxProc)));
 
@@ -284,11 +392,9 @@ mxProc *openPID(const char *binFileName, const char *pid, int plddMode)
    // Set pid now so that if anything else fails, the cleanup should send SIGCONT
    p->pid = atoi(pid);
 
-   if (kill(p->pid, SIGSTOP) == -1)
-   {
-      perror("kill: ");
-      fatal_error("Failed to send continue signal to process %d.", p->pid);
-   }
+   // Snapshots only stop the process once everything is loaded, as its address space can be read while it runs
+   if (mode != mxAttachNone && mode != mxAttachSnapshot)
+      stopProcess(p);
 
    if (binFileName == NULL)
    {
@@ -312,8 +418,19 @@ mxProc *openPID(const char *binFileName, const char *pid, int plddMode)
    int elfID = openElfFile(p,  binFileName, 0, 0, 1);
    loadSymbols(p, elfID, 0);
    loadLibraries(p,elfID,"/", plddMode);
+   buildSegmentIndex(p);
+   buildSymbolIndex(p);
+
+   if (mode == mxAttachSnapshot)
+      stopProcess(p);
+   getLWPsFromPID(p, lwp);
 
-   getLWPsFromPID(p);
+   // There's no way to read the registers of a running LWP, so passive attaches copy the stacks of the stopped process
+   if (mode == mxAttachSnapshot || mode == mxAttachPassive)
+   {
+      captureMemorySnapshot(p);
+      detachMxProcPID(p);
+   }
 
    return p;
 }
@@ -334,7 +451,7 @@ Elf_Addr processSignalHandler(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp
    if (curr_ret_addr == SIG_RETURN)
    {
       if (fullStack)
-         printf("****** Signal handler\n");
+         fprintf(getOutputFile(), "****** Signal handler\n");
 
       // ucontext_t is passed as the 3rd argument to the handler.  It contains the saved registers, allowing us to get the function pointer
       Elf_Addr ucontext_addr = 0;
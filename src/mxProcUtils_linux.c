@@ -20,92 +20,400 @@
 #include <cxxabi.h>
 #include <signal.h>
 #include <ucontext.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/perf_event.h>
+#include <asm/perf_regs.h>
 
 #include "mxProcUtils.h"
 
 void readFile(const mxProc * c, int elfID, Elf_Addr fileAddr, void *buffPointer, size_t size)
 {
-   if (lseek(c->elfFile[elfID].fd,fileAddr,SEEK_SET) != (off_t) fileAddr)
+   if (!readFileMapped(c, elfID, fileAddr, buffPointer, size))
+      return;
+
+   // pread rather than lseek/read, as the fd is shared by the threads unwinding LWPs
+   if (pread(c->elfFile[elfID].fd, buffPointer, size, fileAddr) == -1)
    {
-      fatal_error("Failed to seek offset " FMT_ADR " in file %d.",fileAddr, elfID);
+      fatal_error("Failed to read offset " FMT_ADR " in file %d.",fileAddr, elfID);
    }
-   read(c->elfFile[elfID].fd, buffPointer, size);
 }
 
-void closeMxProcPID(mxProc * p)
+static int seizeUnsupported = 0;   // Kernels before 3.4 only have PTRACE_ATTACH
+static pid_t firstLWP = 0;         // The LWP stopped by openPID(), which ptrace reads go through
+static int firstStopSignal = 0;    // Signal it stopped with
+static int passiveMode = 0;        // See getLWPsPassively()
+static struct timeval stopStart;   // When it was stopped
+static long stoppedMs = 0;         // How long it has been stopped for in total, see stopMxProcPID()
+static int nStops = 0;
+
+static long msSince(const struct timeval *start)
 {
-   int i;
+   struct timeval now;
+   gettimeofday(&now, NULL);
+   return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
 
-   for (i = 0; i < p->nLWPs; i++)
+// Once every LWP is stopped the mappings can't change, so /proc/<pid>/maps is only read once until we detach.
+// Passive attaches also cache them while copying the stacks, as stacks are rarely remapped.  isFileMappedAt
+// caches them too, but those may be read while the process runs so they aren't used to find stacks.
+typedef struct
+{
+   Elf_Addr start;
+   Elf_Addr end;
+   unsigned long inode;
+   unsigned int devMajor;
+   unsigned int devMinor;
+   int deleted;
+} mxCachedMap_t;
+
+static int nCachedMaps = 0;
+static int maxCachedMaps = 0;
+static int cachedMapsStopped = 0;
+static pid_t cachedMapsPID = 0;
+static mxCachedMap_t *cachedMaps = NULL;   // in address order
+
+static void freeCachedMaps()
+{
+   free(cachedMaps);
+   cachedMaps = NULL;
+   nCachedMaps = 0;
+   maxCachedMaps = 0;
+   cachedMapsStopped = 0;
+}
+
+static int cacheMaps(const mxProc * p, int stopped)
+{
+   char fileName[128];
+   snprintf(fileName, sizeof(fileName), "/proc/%d/maps", p->pid);
+
+   nCachedMaps = 0;
+   cachedMapsStopped = 0;
+   cachedMapsPID = p->pid;
+   FILE *f = fopen(fileName, "r");
+   if (!f)
+      return 1;
+
+   // start-end perms offset major:minor inode path
+   char line[LINE_BUFFER_SIZE];
+   while (fgets(line, sizeof(line), f))
    {
-      if (ptrace(PTRACE_DETACH, p->LWPs[i].lwpID, NULL, NULL) == -1)
+      unsigned long mapStart, mapEnd, inode = 0;
+      unsigned int devMajor = 0, devMinor = 0;
+      if (sscanf(line, "%lx-%lx %*s %*x %x:%x %lu", &mapStart, &mapEnd, &devMajor, &devMinor, &inode) < 2)
+         continue;
+
+      if (nCachedMaps == maxCachedMaps)
+      {
+         maxCachedMaps = maxCachedMaps ? 2 * maxCachedMaps : 1024;
+         cachedMaps = static_cast<mxCachedMap_t *>(realloc(cachedMaps, maxCachedMaps * sizeof(mxCachedMap_t)));
+      }
+      mxCachedMap_t *map = cachedMaps + nCachedMaps++;
+      map->start = mapStart;
+      map->end = mapEnd;
+      map->inode = inode;
+      map->devMajor = devMajor;
+      map->devMinor = devMinor;
+      map->deleted = strstr(line, " (deleted)") != NULL;
+   }
+
+   fclose(f);
+   cachedMapsStopped = stopped;
+   debug("Cached %d mappings of process %d", nCachedMaps, p->pid);
+   return 0;
+}
+
+static const mxCachedMap_t *findCachedMap(Elf_Addr vmAddr)
+{
+   int lo = 0, hi = nCachedMaps;
+   while (lo < hi)
+   {
+      int mid = (lo + hi) / 2;
+      if (cachedMaps[mid].start <= vmAddr)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (!lo || vmAddr >= cachedMaps[lo - 1].end)
+      return NULL;
+   return cachedMaps + lo - 1;
+}
+
+void detachMxProcPID(mxProc * p)
+{
+   // Lets the process run again.  Memory can still be read, but not through ptrace.
+   if (!p->attached)
+      return;
+   p->attached = 0;
+   freeCachedMaps();
+   invalidatePageCache(p);
+
+   for (int i = 0; i < p->nLWPs; i++)
+   {
+      // Pass on any signal that arrived while we were attaching
+      long stopSignal = p->LWPs[i].stopSignal;
+      if (ptrace(PTRACE_DETACH, p->LWPs[i].lwpID, NULL, reinterpret_cast<void *>(stopSignal)) == -1)
       {
          perror("ptrace: ");
          printf("Failed to detatch from process %ld.\n", (long) p->LWPs[i].lwpID);
       }
    }
+
+   if (p->nLWPs)
+   {
+      stoppedMs += msSince(&stopStart);
+      nStops++;
+   }
 }
 
-void getLWPsFromPID(mxProc * p)
+void closeMxProcPID(mxProc * p)
 {
-   char fileName[128];
+   if (p->as > 0)
+      close(p->as);
+
+   detachMxProcPID(p);
+   freeCachedMaps();
+
+   if (nStops)
+   {
+      fflush(stdout);
+      if (nStops == 1)
+         fprintf(stderr, "Process %d was stopped for %ld ms\n", p->pid, stoppedMs);
+      else
+         fprintf(stderr, "Process %d was stopped %d times for %ld ms in total\n", p->pid, nStops, stoppedMs);
+   }
+}
+
+static int attachLWP(pid_t lwpID)
+{
+   // Asks lwpID to stop, without waiting for it.  Returns 1 if the LWP has already gone.
+#ifdef PTRACE_SEIZE
+   if (!seizeUnsupported)
+   {
+      if (ptrace(PTRACE_SEIZE, lwpID, NULL, NULL) == 0)
+      {
+         if (ptrace(PTRACE_INTERRUPT, lwpID, NULL, NULL) == 0)
+            return 0;
+      }
+      else if (errno == EIO || errno == EINVAL)
+      {
+         debug("PTRACE_SEIZE unsupported, errno %d.  Using PTRACE_ATTACH", errno);
+         seizeUnsupported = 1;
+      }
+   }
+#else
+   seizeUnsupported = 1;
+#endif
+
+   if (seizeUnsupported && ptrace(PTRACE_ATTACH, lwpID, NULL, NULL) == 0)
+      return 0;
+
+   if (errno == ESRCH)
+   {
+      debug("LWP %d exited before we could attach", lwpID);
+      return 1;
+   }
+
+   perror("ptrace: ");
+   fatal_error("Failed to attach to process/LWP %d", lwpID);
+   return 1;
+}
+
+static int waitLWP(pid_t lwpID, int *stopSignal)
+{
+   // Waits for an LWP to stop after attachLWP().  Returns 1 if it exited instead.
+   // If it stopped for a signal other than ours, the signal is returned so it can be passed on when detaching.
+   int status;
+   *stopSignal = 0;
+
+   while (waitpid(lwpID, &status, __WALL) == -1)
+   {
+      if (errno != EINTR)
+      {
+         debug("Unable to wait for LWP %d, errno %d", lwpID, errno);
+         return 1;
+      }
+   }
+
+   if (!WIFSTOPPED(status))
+   {
+      debug("LWP %d exited while we were attaching", lwpID);
+      return 1;
+   }
+
+#ifdef PTRACE_SEIZE
+   // Our interrupt, or a group stop, is reported as PTRACE_EVENT_STOP
+   if (!seizeUnsupported && status >> 16 == PTRACE_EVENT_STOP)
+      return 0;
+#endif
+
+   if (!seizeUnsupported || WSTOPSIG(status) != SIGSTOP)
+   {
+      debug("LWP %d stopped with signal %d", lwpID, WSTOPSIG(status));
+      *stopSignal = WSTOPSIG(status);
+   }
+
+   return 0;
+}
+
+static int getLWPRegisters(pid_t lwpID, struct user_regs_struct *regs)
+{
+#ifdef PTRACE_GETREGSET
+   struct iovec iov;
+   iov.iov_base = regs;
+   iov.iov_len = sizeof(*regs);
+   if (ptrace(PTRACE_GETREGSET, lwpID, reinterpret_cast<void *>(NT_PRSTATUS), &iov) == 0)
+      return 0;
+#endif
+
+   return ptrace(PTRACE_GETREGS, lwpID, NULL, regs) == -1;
+}
+
+static void setLWPRegisters(mxLWP_t *lwp, const struct user_regs_struct *regs)
+{
+#if defined (__x86_64)
+   lwp->fp = (Elf_Addr) regs->rbp;
+   lwp->sp = (Elf_Addr) regs->rsp;
+   lwp->ip = (Elf_Addr) regs->rip;
+#else
+   lwp->fp = (Elf_Addr) regs->ebp;
+   lwp->sp = (Elf_Addr) regs->esp;
+   lwp->ip = (Elf_Addr) regs->eip;
+#endif
+}
 
+static int scanLWPs(const mxProc *p, pid_t **lwpIDs, int *maxLWPs)
+{
+   // Lists the threads of the process in /proc/<pid>/task order, growing lwpIDs as needed
+   char fileName[128];
    snprintf(fileName, sizeof(fileName), "/proc/%d/task", p->pid);
    struct dirent **namelist;
 
    int nFiles = scandir(fileName, &namelist, 0, alphasort);
-   int t;
+   int nLWPs = 0;
 
-   for (t = 0; t < nFiles; t++)
+   for (int t = 0; t < nFiles; t++)
    {
       char *slwpID = namelist[t]->d_name;
 
-      if (slwpID[0] == '.')     // . or ..
-         continue;
+      if (slwpID[0] != '.')     // . or ..
+      {
+         *lwpIDs = static_cast<pid_t *>(growArray(*lwpIDs, maxLWPs, sizeof(pid_t), nLWPs + 1));
+         (*lwpIDs)[nLWPs++] = atoi(slwpID);
+      }
 
-      pid_t lwpID = atoi(slwpID);
-      struct user_regs_struct regs;
+      free(namelist[t]);
+   }
+
+   if (nFiles > 0)
+      free(namelist);
+
+   return nLWPs;
+}
 
-      // We have already attached to the main process.  Also attach to the others
-      if (p->pid != lwpID)
+void getLWPsFromPID(mxProc * p, int lwp)
+{
+   // Interrupt all the threads before waiting for any of them, so they stop together.  Threads can be
+   // created until they have all stopped, so keep scanning /proc/<pid>/task until no new ones turn up.
+   // If a single LWP was asked for, openPID() has already stopped it and the others are left running.
+   pid_t *attached = NULL;
+   int *stopSignal = NULL;
+   pid_t *found = NULL;
+   int maxAttached = 0;
+   int maxStopSignals = 0;
+   int maxFound = 0;
+   int nAttached = 0;
+   int nFound = 0;
+   int nScans = 0;
+
+   // We have already attached to the first thread
+   attached = static_cast<pid_t *>(growArray(attached, &maxAttached, sizeof(pid_t), 1));
+   stopSignal = static_cast<int *>(growArray(stopSignal, &maxStopSignals, sizeof(int), 1));
+   attached[nAttached] = firstLWP;
+   stopSignal[nAttached++] = firstStopSignal;
+
+   if (lwp)
+   {
+      found = static_cast<pid_t *>(growArray(found, &maxFound, sizeof(pid_t), 1));
+      found[nFound++] = firstLWP;
+   }
+
+   while (!lwp)
+   {
+      nFound = scanLWPs(p, &found, &maxFound);
+      nScans++;
+
+      int first = nAttached;
+      for (int i = 0; i < nFound; i++)
       {
-         if (ptrace(PTRACE_ATTACH, lwpID, NULL, NULL) == -1)
+         int known = 0;
+         for (int j = 0; j < nAttached && !known; j++)
+            known = attached[j] == found[i];
+
+         if (!known && !attachLWP(found[i]))
          {
-            perror("ptrace: ");
-            fatal_error("Failed to attach to process/LWP %d", lwpID);
+            attached = static_cast<pid_t *>(growArray(attached, &maxAttached, sizeof(pid_t), nAttached + 1));
+            stopSignal = static_cast<int *>(growArray(stopSignal, &maxStopSignals, sizeof(int), nAttached + 1));
+            attached[nAttached++] = found[i];
          }
+      }
+
+      if (first == nAttached)
+         break;
 
-         // We really should use waitpid(lwpID,&status,0) here, but there
-         // appears to be some quirkly linux behaviour/bug that I can't work out
-         usleep(1000);
+      for (int i = first; i < nAttached; i++)
+      {
+         if (waitLWP(attached[i], stopSignal + i))
+            attached[i] = 0;   // It has gone, don't let it be matched
       }
+   }
+
+   // Keep the order of /proc/<pid>/task
+   for (int i = 0; i < nFound; i++)
+   {
+      int j;
+      for (j = 0; j < nAttached; j++)
+         if (attached[j] == found[i])
+            break;
+      if (j == nAttached)
+         continue;
+
+      pid_t lwpID = found[i];
+      struct user_regs_struct regs;
 
-      if (ptrace(PTRACE_GETREGS, lwpID, NULL, &regs) == -1)
+      if (getLWPRegisters(lwpID, &regs))
       {
+         if (errno == ESRCH && lwpID != firstLWP)
+         {
+            debug("LWP %d exited while we were attaching", lwpID);
+            continue;
+         }
          perror("ptrace: ");
          fatal_error("Unable to read LWP %d info", lwpID);
       }
 
-      mxLWP_t *lwp = &(p->LWPs[p->nLWPs++]);
+      mxLWP_t *lwp = addLWP(p);
 
       lwp->lwpID = lwpID;
-#if defined (__x86_64)
-      lwp->fp = (Elf_Addr) regs.rbp;
-      lwp->sp = (Elf_Addr) regs.rsp;
-      lwp->ip = (Elf_Addr) regs.rip;
-#else
-      lwp->fp = (Elf_Addr) regs.ebp;
-      lwp->sp = (Elf_Addr) regs.esp;
-      lwp->ip = (Elf_Addr) regs.eip;
-#endif
+      setLWPRegisters(lwp, &regs);
       lwp->stack = 0;
       lwp->stacksize = 0;
-
-      free(namelist[t]);
-      if (p->nLWPs >= MAX_LWPS)
-         break;
+      lwp->stopSignal = stopSignal[j];
    }
-   free(namelist);
+
+   debug("Stopped %d LWPs after %d scans, %ld ms after the main thread", p->nLWPs, nScans, msSince(&stopStart));
+   cacheMaps(p, 1);
+
+   free(found);
+   free(stopSignal);
+   free(attached);
 }
 
 void getLWPsFromCore(mxProc * c)
@@ -143,7 +451,7 @@ void getLWPsFromCore(mxProc * c)
 
             const struct user_regs_struct *regs = reinterpret_cast<const struct user_regs_struct *>(&(s.pr_reg));
 
-            mxLWP_t *lwp = &(c->LWPs[c->nLWPs++]);
+            mxLWP_t *lwp = addLWP(c);
 
             lwp->lwpID = s.pr_pid;
             debug("Loaded LWPID %d",lwp->lwpID);
@@ -180,110 +488,215 @@ void getLWPsFromCore(mxProc * c)
          }
 
          nOff = nOff + dataSize;
-         if (c->nLWPs >= MAX_LWPS)
-            break;
       }
    }
 }
 
-int readMxProcVM(const mxProc * p, Elf_Addr vmAddr, void *buffPointer, size_t size)
-{
-   char *buff = static_cast<char *>(buffPointer);
+// Methods for reading a live process's memory, fastest first.  Once a method is found not to work, we stop trying it.
+// --jobs workers read concurrently, so the flags are only set atomically.
+static volatile int vmReadvUnsupported = 0;
+static volatile int procMemUnsupported = 0;
 
-   memset(buff, 0, size);       // Calling functions should check the return value, but in case they dont.....
+static size_t readPIDMemoryVMReadv(const mxProc * p, Elf_Addr vmAddr, char *buff, size_t size)
+{
+#ifdef SYS_process_vm_readv
+   // Failures are reported per iovec, so split the remote range on page boundaries to get page granularity on partial reads
+   static long pageSize = sysconf(_SC_PAGESIZE);
+   struct iovec remote[64];
+   size_t nRead = 0;
 
-   if (p->type == mxProcTypeCore)
+   while (nRead < size)
    {
-      // Find file address
-      Elf_Addr fileAddr = 0;
-      int elfFile = 0;
-      getFileAddrFromCore(p, vmAddr, &fileAddr, &elfFile, COREFIRST);
-      //debug("found file address " FMT_ADR " for " FMT_ADR " in %s",fileAddr,vmAddr,p->elfFile[elfFile].fileName);
+      int nIov = 0;
+      size_t batch = 0;
+      Elf_Addr addr = vmAddr + nRead;
 
-      if (!fileAddr)
+      while (nIov < (int) (sizeof(remote) / sizeof(remote[0])) && nRead + batch < size)
       {
-         debug("Could not find vm address " FMT_ADR " in the core file.  Check pmap.", vmAddr);
-         return 1;
+         size_t len = pageSize - (addr % pageSize);
+         if (len > size - nRead - batch)
+            len = size - nRead - batch;
+         remote[nIov].iov_base = reinterpret_cast<void *>(addr);
+         remote[nIov].iov_len = len;
+         nIov++;
+         addr += len;
+         batch += len;
       }
 
-      Elf_Addr endAddr = 0;
-      int endElfFile = 0;
-      getFileAddrFromCore(p, vmAddr + size - 1, &endAddr, &endElfFile, COREFIRST);
+      struct iovec local;
+      local.iov_base = buff + nRead;
+      local.iov_len = batch;
 
-      if (!endAddr)
+      long ret = syscall(SYS_process_vm_readv, p->pid, &local, 1, remote, nIov, 0);
+      if (ret == -1)
       {
-         debug("Memory address goes beyond mapped areas (base " FMT_ADR " + size %#lx).  Check pmap.", vmAddr, size);
-         return 1;
+         if ((errno == ENOSYS || errno == EPERM) && !__sync_lock_test_and_set(&vmReadvUnsupported, 1))
+            debug("process_vm_readv not available (errno %d), falling back to /proc/%d/mem", errno, p->pid);
+         break;
       }
 
-      if (elfFile!=endElfFile)
-      {
-         debug("Memory address " FMT_ADR " goes across 2 elf files.", vmAddr);
-         return 1;
-      }
+      nRead += ret;
+      if ((size_t) ret != batch)
+         break;
+   }
 
-      if (fileAddr == ADDR_NULLVALUES && endAddr == ADDR_NULLVALUES)
-      {
-         // Valid, but unused memory space.  Return null values.
-         return 0;
-      }
-      else if (fileAddr == ADDR_NULLVALUES || endAddr == ADDR_NULLVALUES)
-      {
-         debug("Reads across used/unused memory boundaries are not supported (base " FMT_ADR " + size %#lx).", vmAddr, size);
-         return 1;
-      }
+   return nRead;
+#else
+   __sync_lock_test_and_set(&vmReadvUnsupported, 1);
+   return 0;
+#endif
+}
 
-      readFile(p, elfFile, fileAddr, buff, size);
+static size_t readPIDMemoryProcMem(const mxProc * p, Elf_Addr vmAddr, char *buff, size_t size)
+{
+   // /proc/<pid>/mem stops at the first page it can't access
+   size_t nRead = 0;
+
+   while (nRead < size)
+   {
+      ssize_t ret = pread(p->as, buff + nRead, size - nRead, (off_t) (vmAddr + nRead));
+      if (ret == -1 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         break;
+      nRead += ret;
    }
-   else if (p->type == mxProcTypePID)
+
+   return nRead;
+}
+
+static size_t readPIDMemoryPeek(const mxProc * p, Elf_Addr vmAddr, char *buff, size_t size)
+{
+   // One word at a time.  Very slow, so only used if nothing else works.
+   size_t nRead = 0;
+   Elf_Off startOff = (unsigned long) vmAddr % (unsigned long) sizeof(long);
+   Elf_Addr wordAddr = vmAddr - startOff;
+
+   while (nRead < size)
    {
       long val;
+      errno = 0;
+      if ((val = ptrace(PTRACE_PEEKDATA, firstLWP, wordAddr, NULL)) == -1 && errno)
+         break;
+
+      size_t nBytes = sizeof(long) - startOff;
+      if (nBytes > size - nRead)
+         nBytes = size - nRead;
+
+      memcpy(buff + nRead, startOff + (char *) (&val), nBytes);
+      nRead += nBytes;
+      wordAddr += sizeof(long);
+      startOff = 0;
+   }
+
+   return nRead;
+}
+
+static size_t readPIDMemory(const mxProc * p, Elf_Addr vmAddr, char *buff, size_t size)
+{
+   // Returns the number of bytes read.  Short reads stop at the first unreadable page.
+   if (!vmReadvUnsupported)
+   {
+      size_t nRead = readPIDMemoryVMReadv(p, vmAddr, buff, size);
+      if (!vmReadvUnsupported)
+         return nRead;
+   }
+
+   if (!procMemUnsupported && p->as > 0)
+   {
+      size_t nRead = readPIDMemoryProcMem(p, vmAddr, buff, size);
+      if (nRead)
+         return nRead;
+
+      // Some kernels don't allow reading /proc/<pid>/mem at all.  Check the same word with ptrace before giving up on it.
+      errno = 0;
+      if (ptrace(PTRACE_PEEKDATA, firstLWP, vmAddr - vmAddr % sizeof(long), NULL) == -1 && errno)
+         return 0;
+
+      if (!__sync_lock_test_and_set(&procMemUnsupported, 1))
+         debug("/proc/%d/mem not readable, falling back to ptrace", p->pid);
+   }
+
+   if (!p->attached)
+      return 0;
+
+   return readPIDMemoryPeek(p, vmAddr, buff, size);
+}
+
+int canReadFromAnyThread(const mxProc * p)
+{
+   // Returns 0 if the memory of p can only be read with ptrace, which only works from the thread that attached
+   if (p->type != mxProcTypePID)
+      return 1;
+   return !vmReadvUnsupported || (!procMemUnsupported && p->as > 0);
+}
 
-      Elf_Off startOff = (unsigned long) vmAddr % (unsigned long) sizeof(long);   // TODO Reading off-alignment addresses and sizes needs further testing
+int getVMRegionFromPID(const mxProc * p, Elf_Addr vmAddr, Elf_Addr *start, Elf_Addr *end)
+{
+   // Find the mapping containing vmAddr from /proc/<pid>/maps.  Returns 0 if found.
+   if (cachedMapsStopped && cachedMapsPID == p->pid)
+   {
+      const mxCachedMap_t *map = findCachedMap(vmAddr);
+      if (!map)
+         return 1;
 
-      //debug("vmAddr " FMT_ADR " buff " FMT_ADR " size " FMT_ADR " startOff " FMT_ADR "\n",vmAddr, buff, size, startOff);
+      *start = map->start;
+      *end = map->end;
+      return 0;
+   }
+
+   char fileName[128];
+   snprintf(fileName, sizeof(fileName), "/proc/%d/maps", p->pid);
 
-      if (startOff)
+   FILE *f = fopen(fileName, "r");
+   if (!f)
+      return 1;
+
+   char line[LINE_BUFFER_SIZE];
+   int notFound = 1;
+   while (notFound && fgets(line, sizeof(line), f))
+   {
+      unsigned long mapStart, mapEnd;
+      if (sscanf(line, "%lx-%lx", &mapStart, &mapEnd) == 2 && vmAddr >= mapStart && vmAddr < mapEnd)
       {
-         vmAddr -= (sizeof(long) - startOff);   // Roll back the vm address back a few bytes to be on a word boundary
-         if ((val = ptrace(PTRACE_PEEKDATA, p->pid, vmAddr, NULL)) == -1 && errno)
-         {
-            //perror("ptrace: ");
-            debug("Failed to read %ld bytes of data from " FMT_ADR " in PID %ld", sizeof(long), vmAddr, (long) p->pid);
-            return 1;
-         }
-         //printf("vmAddr %x buff %x size %x startOff %x\n",vmAddr, buff, size, startOff);
-         size_t nBytes = size >= startOff ? startOff : size;
-         memcpy(buff, sizeof(long) - startOff + (char *) (&val), nBytes);
-         vmAddr += sizeof(long);
-         buff += startOff;
-         if (size >= startOff) // Avoid overflow on small reads
-            size -= startOff;
-         else
-            size = 0;
+         *start = mapStart;
+         *end = mapEnd;
+         notFound = 0;
       }
+   }
 
-      while (size)
-      {
-         if ((val = ptrace(PTRACE_PEEKDATA, p->pid, vmAddr, NULL)) == -1 && errno)
-         {
-            //perror("ptrace: ");
-            debug("Failed to read %ld bytes of data from " FMT_ADR " in PID %ld", sizeof(long), vmAddr, (long) p->pid);
-            return 1;
-         }
-         size_t nBytes = size < sizeof(long) ? size : sizeof(long);
+   fclose(f);
+   return notFound;
+}
 
-         //printf("vmAddr %x buff %x size %x nBytes %x\n",vmAddr, buff, size, nBytes);
-         memcpy(buff, &val, nBytes);
-         vmAddr += nBytes;
-         buff += nBytes;
-         size -= nBytes;
-      }
-      //printf("vmAddr %x buff %x size %x \n",vmAddr, buff, size);
+int isFileMappedAt(const mxProc * p, Elf_Addr start, Elf_Addr end, const mxstat *fileStat)
+{
+   // Returns 1 if every mapping in [start, end) is of the file fileStat was taken from, with no gaps, and it
+   // hasn't been deleted.  The maps are read on the first call and reused for the rest of the segments.
+   if ((!nCachedMaps || cachedMapsPID != p->pid) && cacheMaps(p, 0))
+      return 0;
+
+   for (Elf_Addr vmAddr = start; vmAddr < end;)
+   {
+      const mxCachedMap_t *map = findCachedMap(vmAddr);
+      if (!map || map->deleted || map->inode != (unsigned long) fileStat->st_ino ||
+          map->devMajor != major(fileStat->st_dev) || map->devMinor != minor(fileStat->st_dev))
+         return 0;
+      vmAddr = map->end;
    }
-   else
+
+   return 1;
+}
+
+int readVMFromPID(const mxProc * p, Elf_Addr vmAddr, void *buffPointer, size_t size)
+{
+   char *buff = static_cast<char *>(buffPointer);
+
+   size_t nRead = readPIDMemory(p, vmAddr, buff, size);
+   if (nRead != size)
    {
-      fatal_error("Invalid MxProcType.");
+      debug("Failed to read %ld bytes of data from " FMT_ADR " in PID %ld (read %ld)", (long) size, vmAddr, (long) p->pid, (long) nRead);
+      return 1;
    }
    return 0;
 }
@@ -309,7 +722,405 @@ void demangleSymbolName(const char *symbolName, char *demangled, int size)
    }
 }
 
-mxProc *openPID(const char *binFileName, const char *pid, int plddMode)
+static void listLWPs(mxProc * p, int lwp)
+{
+   // Lists the LWPs without stopping them, so their registers aren't known
+   int maxFound = 0;
+   pid_t *found = static_cast<pid_t *>(growArray(NULL, &maxFound, sizeof(pid_t), 1));
+   int nFound = 1;
+
+   found[0] = firstLWP;
+   if (!lwp)
+      nFound = scanLWPs(p, &found, &maxFound);
+
+   for (int i = 0; i < nFound; i++)
+      addLWP(p)->lwpID = found[i];
+
+   free(found);
+}
+
+#define PASSIVE_ATTEMPTS 3
+
+static int readSyscallRegisters(const mxProc *p, pid_t lwpID, char *line, int size, Elf_Addr *sp, Elf_Addr *pc)
+{
+   // Reads the stack pointer and program counter of a blocked LWP from /proc/<pid>/task/<lwp>/syscall, which holds
+   // "<nr> <args>... <sp> <pc>", or "running".  line is set to its contents.  Returns 0 if the LWP is blocked.
+   char fileName[128];
+   snprintf(fileName, sizeof(fileName), "/proc/%d/task/%d/syscall", p->pid, lwpID);
+
+   FILE *f = fopen(fileName, "r");
+   if (!f)
+      return 1;
+   char *read = fgets(line, size, f);
+   fclose(f);
+
+   if (!read || !strncmp(line, "running", 7))
+      return 1;
+
+   char *pcField = strrchr(line, ' ');
+   if (!pcField || pcField == line)
+      return 1;
+
+   char *spField = pcField - 1;
+   while (spField > line && *spField != ' ')
+      spField--;
+   if (spField == line)
+      return 1;
+
+   *sp = (Elf_Addr) strtoul(spField + 1, NULL, 16);
+   *pc = (Elf_Addr) strtoul(pcField + 1, NULL, 16);
+   return 0;
+}
+
+static long readContextSwitches(const mxProc *p, pid_t lwpID)
+{
+   // Returns how many times the LWP has been switched out, from /proc/<pid>/task/<lwp>/status, or -1 if it isn't shown
+   char fileName[128];
+   snprintf(fileName, sizeof(fileName), "/proc/%d/task/%d/status", p->pid, lwpID);
+
+   FILE *f = fopen(fileName, "r");
+   if (!f)
+      return -1;
+
+   char line[LINE_BUFFER_SIZE];
+   long switches = -1;
+   while (fgets(line, sizeof(line), f))
+   {
+      long n;
+      if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1 || sscanf(line, "nonvoluntary_ctxt_switches: %ld", &n) == 1)
+         switches = (switches < 0 ? 0 : switches) + n;
+   }
+   fclose(f);
+   return switches;
+}
+
+static int copyStackBriefly(const mxProc *p, mxLWP_t *t, mxStackSnapshot_t *region)
+{
+   // Stops a running LWP just long enough to read its registers and copy its stack.  Returns 0 on success.
+   int stopSignal = 0;
+   if (attachLWP(t->lwpID) || waitLWP(t->lwpID, &stopSignal))
+      return 1;
+
+   struct user_regs_struct regs;
+   int failed = getLWPRegisters(t->lwpID, &regs);
+   if (!failed)
+   {
+      setLWPRegisters(t, &regs);
+      failed = copyStack(p, *t, region);
+   }
+
+   ptrace(PTRACE_DETACH, t->lwpID, NULL, reinterpret_cast<void *>(static_cast<long>(stopSignal)));
+   return failed;
+}
+
+static void getLWPsPassively(mxProc * p, int lwp)
+{
+   // Blocked LWPs show their stack pointer and program counter in /proc, so their stacks can be copied while they keep
+   // running.  The frame pointer isn't known, the unwinder searches for it from sp.  If the syscall file or the number of
+   // context switches changes while the stack is copied, the LWP woke up and the copy may be torn, so try again.  The
+   // syscall file alone misses an LWP that ran and blocked again in the same call.  Running LWPs are stopped briefly.
+   int maxFound = 0;
+   pid_t *found = static_cast<pid_t *>(growArray(NULL, &maxFound, sizeof(pid_t), 1));
+   int nFound = 1;
+   int nStopped = 0;
+   int nTorn = 0;
+
+   found[0] = firstLWP;
+   if (!lwp)
+      nFound = scanLWPs(p, &found, &maxFound);
+
+   setMemorySnapshot(p, NULL);
+   cacheMaps(p, 1);
+
+   mxMemorySnapshot_t *snapshot = static_cast<mxMemorySnapshot_t *>(calloc(1, sizeof(mxMemorySnapshot_t)));
+   snapshot->region = static_cast<mxStackSnapshot_t *>(calloc(nFound, sizeof(mxStackSnapshot_t)));
+
+   for (int i = 0; i < nFound; i++)
+   {
+      mxLWP_t t;
+      memset(&t, 0, sizeof(t));
+      t.lwpID = found[i];
+
+      mxStackSnapshot_t *region = snapshot->region + snapshot->nRegions;
+      char before[LINE_BUFFER_SIZE];
+      char after[LINE_BUFFER_SIZE];
+      int copied = 0;
+
+      for (int attempt = 0; attempt < PASSIVE_ATTEMPTS && !copied; attempt++)
+      {
+         long switches = readContextSwitches(p, t.lwpID);
+         if (readSyscallRegisters(p, t.lwpID, before, sizeof(before), &t.sp, &t.ip) || copyStack(p, t, region))
+            break;
+
+         if (!readSyscallRegisters(p, t.lwpID, after, sizeof(after), &t.sp, &t.ip) && !strcmp(before, after) &&
+             readContextSwitches(p, t.lwpID) == switches)
+         {
+            copied = 1;
+         }
+         else
+         {
+            free(region->data);
+            region->data = NULL;
+            nTorn++;
+         }
+      }
+
+      if (!copied)
+      {
+         t.sp = t.ip = 0;
+         if (copyStackBriefly(p, &t, region))
+         {
+            debug("Unable to stop LWP %d, it may have exited", t.lwpID);
+            continue;
+         }
+         nStopped++;
+      }
+
+      snapshot->nRegions++;
+      *addLWP(p) = t;
+   }
+
+   freeCachedMaps();
+   setMemorySnapshot(p, snapshot);
+   debug("Copied the stacks of %d LWPs, %d were stopped briefly and %d copies were torn", p->nLWPs, nStopped, nTorn);
+   free(found);
+}
+
+// Sampling with perf events, see samplePerfEvents()
+#define PERF_REGS_MASK ((1ULL << PERF_REG_X86_BP) | (1ULL << PERF_REG_X86_SP) | (1ULL << PERF_REG_X86_IP))
+#define PERF_STACK_SIZE 16384     // Bytes of stack copied from the stack pointer with each sample
+#define PERF_DATA_PAGES 16        // Size of each ring buffer, must be a power of 2
+
+typedef struct
+{
+   int fd;
+   pid_t lwpID;
+   size_t mapSize;
+   struct perf_event_mmap_page *page; // The first page of the mapping, followed by the ring buffer
+   char *data;
+   size_t dataSize;
+} mxPerfEvent_t;
+
+static int openPerfEvent(pid_t lwpID, long intervalMs, mxPerfEvent_t *e)
+{
+   // Samples the user registers and stack of lwpID every intervalMs of the time it runs
+   struct perf_event_attr attr;
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = PERF_TYPE_SOFTWARE;
+   attr.config = PERF_COUNT_SW_TASK_CLOCK;
+   attr.sample_period = intervalMs * 1000000;
+   attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+   attr.sample_regs_user = PERF_REGS_MASK;
+   attr.sample_stack_user = PERF_STACK_SIZE;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   attr.disabled = 1;
+   attr.wakeup_events = 1;
+
+   e->fd = syscall(SYS_perf_event_open, &attr, lwpID, -1, -1, 0);
+   if (e->fd == -1)
+      return 1;
+
+   size_t pageSize = sysconf(_SC_PAGESIZE);
+   e->mapSize = (1 + PERF_DATA_PAGES) * pageSize;
+   void *map = mmap(NULL, e->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd, 0);
+   if (map == MAP_FAILED)
+   {
+      close(e->fd);
+      return 1;
+   }
+
+   e->lwpID = lwpID;
+   e->page = static_cast<struct perf_event_mmap_page *>(map);
+   e->data = static_cast<char *>(map) + pageSize;
+   e->dataSize = PERF_DATA_PAGES * pageSize;
+   return 0;
+}
+
+static void closePerfEvent(mxPerfEvent_t *e)
+{
+   munmap(e->page, e->mapSize);
+   close(e->fd);
+}
+
+static void readPerfRing(const mxPerfEvent_t *e, __u64 offset, void *buff, size_t size)
+{
+   // Records can wrap around the end of the ring buffer
+   size_t start = offset % e->dataSize;
+   size_t first = size < e->dataSize - start ? size : e->dataSize - start;
+   memcpy(buff, e->data + start, first);
+   memcpy(static_cast<char *>(buff) + first, e->data, size - first);
+}
+
+static int processPerfSample(const mxProc *p, const char *record, size_t size, mxSampleCallback *callback, void *arg)
+{
+   // A PERF_RECORD_SAMPLE is laid out as: header, pid, tid, abi, regs[], stack size, stack[], dynamic stack size.
+   // Returns 0 if it was passed on to callback.
+   const char *c = record + sizeof(struct perf_event_header);
+   __u32 tid;
+   __u64 abi, regs[3], stackSize, dynSize = 0;
+
+   memcpy(&tid, c + sizeof(__u32), sizeof(tid));
+   c += 2 * sizeof(__u32);
+   memcpy(&abi, c, sizeof(abi));
+   c += sizeof(abi);
+
+   // No user registers, it was in a kernel thread
+   if (abi == PERF_SAMPLE_REGS_ABI_NONE)
+      return 1;
+
+   // In the order of their bits in PERF_REGS_MASK
+   memcpy(regs, c, sizeof(regs));
+   c += sizeof(regs);
+   memcpy(&stackSize, c, sizeof(stackSize));
+   c += sizeof(stackSize);
+   const char *stack = c;
+   if (stackSize && c + stackSize + sizeof(dynSize) <= record + size)
+      memcpy(&dynSize, c + stackSize, sizeof(dynSize));
+
+   // Unwind it like a tiny core, made of the registers and the copied stack
+   mxLWP_t t;
+   memset(&t, 0, sizeof(t));
+   t.lwpID = tid;
+   t.fp = (Elf_Addr) regs[0];
+   t.sp = (Elf_Addr) regs[1];
+   t.ip = (Elf_Addr) regs[2];
+   t.stack = t.sp;
+   t.stacksize = dynSize;
+
+   setStackSnapshot(t.sp, stack, dynSize);
+   callback(p, t, arg);
+   releaseStackSnapshot();
+   return 0;
+}
+
+static long drainPerfEvent(const mxProc *p, mxPerfEvent_t *e, char *record, mxSampleCallback *callback, void *arg)
+{
+   // Processes the records written since the last call, returning the number of samples
+   volatile struct perf_event_mmap_page *page = e->page;
+   __u64 head = page->data_head;
+   __sync_synchronize();
+   __u64 tail = page->data_tail;
+   long nSamples = 0;
+
+   while (tail < head)
+   {
+      struct perf_event_header header;
+      readPerfRing(e, tail, &header, sizeof(header));
+      if (header.size < sizeof(header))
+         break;
+
+      if (header.type == PERF_RECORD_SAMPLE)
+      {
+         readPerfRing(e, tail, record, header.size);
+         if (!processPerfSample(p, record, header.size, callback, arg))
+            nSamples++;
+      }
+      else if (header.type == PERF_RECORD_LOST)
+      {
+         debug("Lost samples of LWP %d", e->lwpID);
+      }
+
+      tail += header.size;
+   }
+
+   __sync_synchronize();
+   page->data_tail = tail;
+   return nSamples;
+}
+
+long samplePerfEvents(const mxProc * p, long intervalMs, long durationMs, mxSampleCallback * callback, void *arg)
+{
+   // Samples the LWPs of p for durationMs without stopping them.  Each LWP has a perf event that copies its registers
+   // and the top of its stack every intervalMs that it runs.  Returns the number of samples, or -1 if there are no events.
+   mxPerfEvent_t *events = static_cast<mxPerfEvent_t *>(malloc(p->nLWPs * sizeof(mxPerfEvent_t)));
+   struct pollfd *fds = static_cast<struct pollfd *>(malloc(p->nLWPs * sizeof(struct pollfd)));
+   int nEvents = 0;
+
+   for (int i = 0; i < p->nLWPs; i++)
+   {
+      if (openPerfEvent(p->LWPs[i].lwpID, intervalMs, events + nEvents))
+      {
+         debug("Unable to open a perf event for LWP %d, errno %d", p->LWPs[i].lwpID, errno);
+         continue;
+      }
+      fds[nEvents].fd = events[nEvents].fd;
+      fds[nEvents].events = POLLIN;
+      nEvents++;
+   }
+
+   if (!nEvents)
+   {
+      free(fds);
+      free(events);
+      return -1;
+   }
+
+   // A record is at most 64KB, as its size is 16 bits
+   char *record = static_cast<char *>(malloc(65536));
+   long nSamples = 0;
+   long elapsed;
+   struct timeval start;
+   gettimeofday(&start, NULL);
+
+   for (int i = 0; i < nEvents; i++)
+      ioctl(events[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+
+   while ((elapsed = msSince(&start)) < durationMs)
+   {
+      poll(fds, nEvents, durationMs - elapsed);
+      for (int i = 0; i < nEvents; i++)
+      {
+         // The LWP has exited, stop polling it
+         if (fds[i].revents & POLLHUP)
+            fds[i].fd = -1;
+         if (fds[i].revents)
+            nSamples += drainPerfEvent(p, events + i, record, callback, arg);
+      }
+   }
+
+   for (int i = 0; i < nEvents; i++)
+   {
+      ioctl(events[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+      nSamples += drainPerfEvent(p, events + i, record, callback, arg);
+      closePerfEvent(events + i);
+   }
+
+   debug("Took %ld samples from %d LWPs in %ld ms", nSamples, nEvents, msSince(&start));
+   free(record);
+   free(fds);
+   free(events);
+   return nSamples;
+}
+
+static void stopFirstLWP(mxProc * p)
+{
+   gettimeofday(&stopStart, NULL);
+   if (attachLWP(firstLWP) || waitLWP(firstLWP, &firstStopSignal))
+      fatal_error("Process %d hasn't stopped", p->pid);
+   p->attached = 1;
+}
+
+void stopMxProcPID(mxProc * p, int lwp)
+{
+   // Stops the process again after detachMxProcPID(), and reads the registers of its LWPs afresh
+   if (p->attached)
+      return;
+
+   invalidatePageCache(p);
+   p->nLWPs = 0;
+   if (passiveMode)
+   {
+      getLWPsPassively(p, lwp);
+      return;
+   }
+
+   stopFirstLWP(p);
+   getLWPsFromPID(p, lwp);
+}
+
+mxProc *openPID(const char *binFileName, const char *pid, int plddMode, mxAttachMode mode, int lwp)
 {
    mxProc *p = static_cast<mxProc *>(malloc(sizeof(mxProc)));
 
@@ -318,16 +1129,32 @@ mxProc *openPID(const char *binFileName, const char *pid, int plddMode)
    p->pid = atoi(pid);
    sprintf(p->filePrefix,"pmx.pid%s",pid);
 
-   if (ptrace(PTRACE_ATTACH, p->pid, NULL, NULL) == -1)
+   // Stop the selected LWP, or the main thread if they are all wanted.  LWP 1 is the main thread.
+   firstLWP = p->pid;
+   if (lwp > 1)
    {
-      perror("ptrace: ");
-      fatal_error("Failed to attach to process %d", p->pid);
+      char taskName[64];
+      snprintf(taskName, sizeof(taskName), "/proc/%d/task/%d", p->pid, lwp);
+      if (access(taskName, F_OK))
+         fatal_error("LWP %d not found in process %d", lwp, p->pid);
+      firstLWP = lwp;
    }
 
-   int status;
-
-   if (p->pid != waitpid(p->pid, &status, 0) || !WIFSTOPPED(status))
-      fatal_error("Process %d hasn't stopped", p->pid);
+   // A snapshot only needs the process stopped while its LWPs and stacks are copied, so it is stopped once
+   // the binary, libraries and indexes are loaded
+   passiveMode = mode == mxAttachPassive;
+   if (mode == mxAttachStop)
+      stopFirstLWP(p);
+
+   // Used to read memory if process_vm_readv isn't available
+   char memFileName[64];
+   snprintf(memFileName, sizeof(memFileName), "/proc/%d/mem", p->pid);
+   p->as = open(memFileName, O_RDONLY);
+   if (p->as == -1)
+   {
+      debug("Unable to open %s, errno %d", memFileName, errno);
+      p->as = 0;
+   }
 
    char fileName[1024];
    if (binFileName == NULL)
@@ -352,8 +1179,25 @@ mxProc *openPID(const char *binFileName, const char *pid, int plddMode)
    int elfID = openElfFile(p,  binFileName, 0, 0, 1);
    loadSymbols(p, elfID, 0);
    loadLibraries(p,elfID,"/", plddMode);
+   buildSegmentIndex(p);
+   buildSymbolIndex(p);
+
+   if (mode == mxAttachNone)
+      listLWPs(p, lwp);
+   else if (passiveMode)
+      getLWPsPassively(p, lwp);
+   else
+   {
+      if (mode == mxAttachSnapshot)
+         stopFirstLWP(p);
+      getLWPsFromPID(p, lwp);
+   }
 
-   getLWPsFromPID(p);
+   if (mode == mxAttachSnapshot)
+   {
+      captureMemorySnapshot(p);
+      detachMxProcPID(p);
+   }
 
    return p;
 }
@@ -395,7 +1239,7 @@ Elf_Addr processSignalHandler(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp
 #if defined (_LP64)
       // We haven't worked out how to get siginfo on x64 as it's passed via a register that is lost
       if (fullStack)
-         printf("****** Signal handler\n");
+         fprintf(getOutputFile(), "****** Signal handler\n");
 #else
       Elf_Addr siginfo_addr = 0;
       readMxProcVM(p, fp + 3 * sizeof(fp), &siginfo_addr, sizeof(fp));
@@ -404,7 +1248,7 @@ Elf_Addr processSignalHandler(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp
       readMxProcVM(p, siginfo_addr, &siginfo, sizeof(siginfo));
 
       if (fullStack)
-         printf("****** Signal handler signo: %d, errno: %d, code: %d, addr: " FMT_ADR "\n", siginfo.si_signo, siginfo.si_errno, siginfo.si_code, (unsigned long)siginfo.si_addr);
+         fprintf(getOutputFile(), "****** Signal handler signo: %d, errno: %d, code: %d, addr: " FMT_ADR "\n", siginfo.si_signo, siginfo.si_errno, siginfo.si_code, (unsigned long)siginfo.si_addr);
 #endif
 
 
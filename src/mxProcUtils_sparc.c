@@ -73,7 +73,7 @@ static int verifyFramePointer(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp
 
    return i;
 }
-static void recurseCallStack(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp, int fullStack, int stackArguments, int corruptStackSearch)
+static void recurseCallStack(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp, int quiet, int corruptStackSearch, mxFrameCallback *callback, void *arg)
 {
     for (int iFrames=1; iFrames++ ; )
     {
@@ -99,36 +99,41 @@ static void recurseCallStack(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp,
            if (!i)
             return;
 
-           warning("Stack corruption detected.  Some stack frames will be missing!");
+           if (!quiet)
+              warning("Stack corruption detected.  Some stack frames will be missing!");
 
         }
 
         fp=nextfp;
 
-        printStackItem(p, curr_ret_addr, fp, fullStack, stackArguments);
+        if (callback(p, curr_ret_addr, fp, arg))
+           return;
 
-        if (iFrames == 300)
+        if (quiet)
+           continue;
+        else if (iFrames == 300)
            warning("Stack overflow detected. pmx may take a long time to complete.");
         else if (!(iFrames % 1000))
            warning("Processed %d frames, currently at "FMT_ADR, iFrames, fp);
     }
 }
 
-void printCallStack(const mxProc * p, mxLWP_t t, int fullStack, int stackArguments, int corruptStackSearch)
+void walkCallStack(const mxProc * p, mxLWP_t t, int fullStack, int quiet, int corruptStackSearch, mxFrameCallback *callback, void *arg)
 {
-   printStackItem(p, t.ip, t.sp+bias, fullStack, stackArguments);
+   if (callback(p, t.ip, t.sp+bias, arg))
+      return;
 
    Elf_Addr stackLimit = t.stack + t.stacksize;
+   adviseMxProcVM(p, t.sp+bias, stackLimit - (t.sp+bias));
 
-   recurseCallStack(p, stackLimit, t.sp+bias, fullStack, stackArguments, corruptStackSearch);
+   recurseCallStack(p, stackLimit, t.sp+bias, quiet, corruptStackSearch, callback, arg);
 }
 
 mxArguments *getArguments(const mxProc *proc, Elf_Addr disAddr, Elf_Addr frameAddr, int verbose)
 {
-    mxArguments *args = reinterpret_cast<mxArguments *>(calloc(sizeof(mxArguments),1));
+    mxArguments *args = newArguments();
    
-    for (int i=0 ; i<MAX_ARGS; i++)
-        addStackArgument(proc, args, i, frameAddr + (8+i)*sizeof(long), sizeof(long));
+    addStackArguments(proc, args, frameAddr + 8*sizeof(long), MAX_ARGS, sizeof(long));
 
     return args;
 }
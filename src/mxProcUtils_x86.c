@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "mxProcUtils.h"
 
@@ -90,7 +91,7 @@ static int verifyFramePointer(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp
    return i;
 }
 
-static void recurseCallStack(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp, int fullStack, int stackArguments, int corruptStackSearch)
+static void recurseCallStack(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp, int fullStack, int quiet, int corruptStackSearch, mxFrameCallback *callback, void *arg)
 {
    for (int iFrames=1; iFrames++ ; )
    {
@@ -119,26 +120,31 @@ static void recurseCallStack(const mxProc * p, Elf_Addr stackLimit, Elf_Addr fp,
          if (!i)
             return;
 
-         warning("Stack corruption detected.  Some stack frames will be missing!");
+         if (!quiet)
+            warning("Stack corruption detected.  Some stack frames will be missing!");
 
       }
 
       fp=nextfp;
 
-      printStackItem(p, curr_ret_addr, fp, fullStack, stackArguments);
+      if (callback(p, curr_ret_addr, fp, arg))
+         return;
 
-      if (iFrames == 300)
+      if (quiet)
+         continue;
+      else if (iFrames == 300)
          warning("Stack overflow detected. pmx may take a long time to complete.");
       else if (!(iFrames % 1000))
          warning("Processed %d frames, currently at " FMT_ADR, iFrames, fp);
    }
 }
 
-void printCallStack(const mxProc * p, mxLWP_t t, int fullStack, int stackArguments, int corruptStackSearch)
+void walkCallStack(const mxProc * p, mxLWP_t t, int fullStack, int quiet, int corruptStackSearch, mxFrameCallback *callback, void *arg)
 {
 
    // On linux, we don't have stack info, so just set the limit to the top of the memory and hope for the best
    Elf_Addr stackLimit = t.stack ? t.stack + t.stacksize : (Elf_Addr) ULONG_MAX;
+   adviseMxProcVM(p, t.sp, stackLimit - t.sp);
 
    // t.fp should point to the top of the next frame on the stack, but in some weird situations on linux it doesn't
    // As an evil work around, lets just look through the first few items on the stack to see if we stumble
@@ -196,8 +202,9 @@ void printCallStack(const mxProc * p, mxLWP_t t, int fullStack, int stackArgumen
       debug("Starting stack trace at " FMT_ADR " (fp " FMT_ADR " + %lx)", (unsigned long) fp, (unsigned long) t.fp, (unsigned long) fp - (unsigned long) t.fp);
    }
 
-   printStackItem(p, t.ip, fp, fullStack, stackArguments);
-   recurseCallStack(p, stackLimit, fp, fullStack, stackArguments, corruptStackSearch);
+   if (callback(p, t.ip, fp, arg))
+      return;
+   recurseCallStack(p, stackLimit, fp, fullStack, quiet, corruptStackSearch, callback, arg);
 }
 
 
@@ -208,46 +215,46 @@ int getFloatArgNumber(unsigned char rex, unsigned char modrm, int verbose)
 
    if (modrm==0x00)
    {
-      verbose && printf("%%xmm0");
+      verbose && fprintf(getOutputFile(), "%%xmm0");
       return 0;
    }
    else if (modrm==0x08)
    {
-      verbose && printf("%%xmm1");
+      verbose && fprintf(getOutputFile(), "%%xmm1");
       return 1;
    }
    else if (modrm==0x10)
    {
-      verbose && printf("%%xmm2");
+      verbose && fprintf(getOutputFile(), "%%xmm2");
       return 2;
    }
    else if (modrm==0x18)
    {
-      verbose && printf("%%xmm3");
+      verbose && fprintf(getOutputFile(), "%%xmm3");
       return 3;
    }
    else if (modrm==0x20)
    {
-      verbose && printf("%%xmm4");
+      verbose && fprintf(getOutputFile(), "%%xmm4");
       return -1;
    }
    else if (modrm==0x28)
    {
-      verbose && printf("%%xmm5");
+      verbose && fprintf(getOutputFile(), "%%xmm5");
       return -1;
    }
    else if (modrm==0x30)
    {
-      verbose && printf("%%xmm6");
+      verbose && fprintf(getOutputFile(), "%%xmm6");
       return -1;
    }
    else if (modrm==0x38)
    {
-      verbose && printf("%%xmm7");
+      verbose && fprintf(getOutputFile(), "%%xmm7");
       return -1;
    }
 
-   verbose && printf("%%error");
+   verbose && fprintf(getOutputFile(), "%%error");
    return -1;
 }
 
@@ -261,42 +268,42 @@ int getArgNumber(unsigned char rex, unsigned char modrm, int verbose)
    {
       if (modrm==0x00)
       {
-         verbose && printf("%%rax");
+         verbose && fprintf(getOutputFile(), "%%rax");
          return -1;
       }
       else if (modrm==0x08)
       {
-         verbose && printf("%%rcx");
+         verbose && fprintf(getOutputFile(), "%%rcx");
          return 3;
       }
       else if (modrm==0x10)
       {
-         verbose && printf("%%rdx");
+         verbose && fprintf(getOutputFile(), "%%rdx");
          return 2;
       }
       else if (modrm==0x18)
       {
-         verbose && printf("%%rbx");
+         verbose && fprintf(getOutputFile(), "%%rbx");
          return -1;
       }
       else if (modrm==0x20)
       {
-         verbose && printf("%%rsp");
+         verbose && fprintf(getOutputFile(), "%%rsp");
          return -1;
       }
       else if (modrm==0x28)
       {
-         verbose && printf("%%rbp");
+         verbose && fprintf(getOutputFile(), "%%rbp");
          return -1;
       }
       else if (modrm==0x30)
       {
-         verbose && printf("%%rsi");
+         verbose && fprintf(getOutputFile(), "%%rsi");
          return 1;
       }
       else if (modrm==0x38)
       {
-         verbose && printf("%%rdi");
+         verbose && fprintf(getOutputFile(), "%%rdi");
          return 0;
       }
    }
@@ -304,91 +311,161 @@ int getArgNumber(unsigned char rex, unsigned char modrm, int verbose)
    {
       if (modrm==0x00)
       {
-         verbose && printf("%%r8");
+         verbose && fprintf(getOutputFile(), "%%r8");
          return 4;
       }
       else if (modrm==0x08)
       {
-         verbose && printf("%%r9");
+         verbose && fprintf(getOutputFile(), "%%r9");
          return 5;
       }
       else if (modrm==0x10)
       {
-         verbose && printf("%%r10");
+         verbose && fprintf(getOutputFile(), "%%r10");
          return -1;
       }
       else if (modrm==0x18)
       {
-         verbose && printf("%%r11");
+         verbose && fprintf(getOutputFile(), "%%r11");
          return -1;
       }
       else if (modrm==0x20)
       {
-         verbose && printf("%%r12");
+         verbose && fprintf(getOutputFile(), "%%r12");
          return -1;
       }
       else if (modrm==0x28)
       {
-         verbose && printf("%%r13");
+         verbose && fprintf(getOutputFile(), "%%r13");
          return -1;
       }
       else if (modrm==0x30)
       {
-         verbose && printf("%%r14");
+         verbose && fprintf(getOutputFile(), "%%r14");
          return -1;
       }
       else if (modrm==0x38)
       {
-         verbose && printf("%%r15");
+         verbose && fprintf(getOutputFile(), "%%r15");
          return -1;
       }
    }
 
-   verbose && printf("%%error");
+   verbose && fprintf(getOutputFile(), "%%error");
    return -1;
 }
 
 
-static void getArguments64(const mxProc *proc, Elf_Addr disAddr, Elf_Addr rbp, int verbose, mxArguments *args)
+typedef struct
+{
+   Elf_Addr start;
+   size_t size;
+   unsigned char code[128];
+}
+mxCodeWindow;
+
+static int readCode(const mxProc *proc, mxCodeWindow *w, Elf_Addr disAddr, unsigned char *rawdiss, size_t n)
+{
+   // The prologue is decoded from a window of code read in one go, rather than one read per instruction
+   if (disAddr < w->start || disAddr + n > w->start + w->size)
+   {
+      w->start = disAddr;
+      w->size = sizeof(w->code);
+      if (readMxProcVM(proc, disAddr, w->code, w->size))
+      {
+         // Probably near the end of the mapping, so just read what we need
+         w->size = n;
+         if (readMxProcVM(proc, disAddr, w->code, n))
+         {
+            w->size = 0;
+            return 1;
+         }
+      }
+   }
+
+   memcpy(rawdiss, w->code + (disAddr - w->start), n);
+   return 0;
+}
+
+#define MAX_REG_ARGS 16
+
+static void queueArgument(mxReadRequest *requests, int *nRequests, mxArgument *arg, int *count, int argNo, Elf_Addr argAddr, int argLength)
+{
+   // Register arguments are read together once the prologue is decoded.  If a register is saved twice, the last one wins.
+   int i;
+   for (i = 0; i < *nRequests && requests[i].buff != &(arg->val.val4); i++)
+      ;
+
+   if (i == MAX_REG_ARGS)
+      return;
+   if (i == *nRequests)
+      (*nRequests)++;
+
+   if (*count < argNo+1)
+      *count = argNo+1;
+
+   arg->size = argLength;
+   requests[i].vmAddr = argAddr;
+   requests[i].size = argLength;
+   requests[i].buff = &(arg->val.val4);
+}
+
+static void addPrologueSlot(mxPrologue_t *prologue, int argNo, int isFloat, long offset, int size)
+{
+   if (prologue->nSlots == MAX_PROLOGUE_SLOTS)
+      return;
+
+   mxPrologueSlot_t *slot = prologue->slot + prologue->nSlots++;
+   slot->argNo = argNo;
+   slot->isFloat = isFloat;
+   slot->offset = offset;
+   slot->size = size;
+}
+
+static int decodeArguments64(const mxProc *proc, Elf_Addr disAddr, int verbose, mxPrologue_t *prologue)
 {
    // Very basic disassembly of start of function to get saved arguments passed via
    // registers and saved on stack.  Only handles unoptimised code and likely
    // needs revisting if we change compilers or compiler versions as this behaviour is
    // not defined by any spec
    //
-   // Will only work if passed an address at the start of a function
+   // Will only work if passed an address at the start of a function.  Returns 1 if the code couldn't be
+   // read, in which case the prologue may be incomplete.
 
    // Some useful info at:
    // http://ref.x86asm.net/coder64.html
    // http://wiki.osdev.org/X86-64_Instruction_Encoding
 
+   mxCodeWindow code;
+   code.size = 0;
+
    unsigned char rawdiss[8];
-   if (readMxProcVM(proc,disAddr,&rawdiss,sizeof(rawdiss)))
-      return;
+   if (readCode(proc,&code,disAddr,rawdiss,sizeof(rawdiss)))
+      return 1;
 
    // Frame pointer save
    if (rawdiss[0] == 0x55) // pushq %rsp
    {
-      verbose && printf(FMT_ADR ": pushq    %%rbp\n", (unsigned long)disAddr);
+      verbose && fprintf(getOutputFile(), FMT_ADR ": pushq    %%rbp\n", (unsigned long)disAddr);
       disAddr++;
    }
    else
    {
       debug("Expected Frame Pointer Save - found %x", rawdiss[0]);
-      return;
+      return 0;
    }
 
    // Set new frame base - TODO - make this more generic
    if ((rawdiss[1]==0x48 && rawdiss[2]==0x89 && rawdiss[3]==0xe5) || // GCC
        (rawdiss[1]==0x48 && rawdiss[2]==0x8b && rawdiss[3]==0xec)) // Solaris Studio
    {
-      verbose && printf(FMT_ADR ": movq     %%rsp,%%rbp\n", (unsigned long)disAddr);
+      verbose && fprintf(getOutputFile(), FMT_ADR ": movq     %%rsp,%%rbp\n", (unsigned long)disAddr);
       disAddr+=3;
    }
    else
    {
       debug("Expected new frame base to be set");
-      return;
+      return 0;
    }
 
    // Soak up any 32bit or 64bit register saves we don't care for
@@ -396,17 +473,17 @@ static void getArguments64(const mxProc *proc, Elf_Addr disAddr, Elf_Addr rbp, i
    // so we can just ignore them
    while (true)
    {
-      if (readMxProcVM(proc,disAddr,&rawdiss,sizeof(rawdiss)))
-         return;
+      if (readCode(proc,&code,disAddr,rawdiss,sizeof(rawdiss)))
+         return 1;
 
       if (rawdiss[0]==0x41 && rawdiss[1]>=0x50 && rawdiss[1]<0x58) // pushq 64bit
       {
-         verbose && printf(FMT_ADR ": pushq    reg %d\n", (unsigned long)disAddr, rawdiss[1]-0x50);
+         verbose && fprintf(getOutputFile(), FMT_ADR ": pushq    reg %d\n", (unsigned long)disAddr, rawdiss[1]-0x50);
          disAddr+=2;
       }
       else if (rawdiss[0]>=0x50 && rawdiss[0]<0x58) // push 32bit
       {
-         verbose && printf(FMT_ADR ": push     reg %d\n", (unsigned long)disAddr, rawdiss[0]-0x50);
+         verbose && fprintf(getOutputFile(), FMT_ADR ": push     reg %d\n", (unsigned long)disAddr, rawdiss[0]-0x50);
          disAddr+=1;
       }
       else
@@ -416,20 +493,20 @@ static void getArguments64(const mxProc *proc, Elf_Addr disAddr, Elf_Addr rbp, i
    }
 
    //Look for Stack Pointer Move
-   if (readMxProcVM(proc,disAddr,&rawdiss,sizeof(rawdiss)))
-      return;
+   if (readCode(proc,&code,disAddr,rawdiss,sizeof(rawdiss)))
+      return 1;
 
    if (rawdiss[0]==0x48 && rawdiss[1]==0x81 && rawdiss[2]==0xec) // move stack point 32bit
    {
       // have to do nasty stuff to make gcc expand the size
       unsigned int *n = reinterpret_cast<unsigned int *>(reinterpret_cast<void*>(rawdiss+3));
-      verbose && printf(FMT_ADR ": subq     0x%x,%%rsp\n", (unsigned long)disAddr, *n);
+      verbose && fprintf(getOutputFile(), FMT_ADR ": subq     0x%x,%%rsp\n", (unsigned long)disAddr, *n);
       disAddr+=7;
    }
    else if (rawdiss[0]==0x48 && rawdiss[1]==0x83 && rawdiss[2]==0xec) // move stack point 8bit
    {
       unsigned char *n = rawdiss+3;
-      verbose && printf(FMT_ADR ": subq     0x%hhx,%%rsp\n", (unsigned long)disAddr, *n);
+      verbose && fprintf(getOutputFile(), FMT_ADR ": subq     0x%hhx,%%rsp\n", (unsigned long)disAddr, *n);
       disAddr+=4;
    }
    else
@@ -440,8 +517,8 @@ static void getArguments64(const mxProc *proc, Elf_Addr disAddr, Elf_Addr rbp, i
    // Look for any moves of registers to the stack, and if it's an argument register, save it
    while (true)
    {
-      if (readMxProcVM(proc,disAddr,&rawdiss,sizeof(rawdiss)))
-         return;
+      if (readCode(proc,&code,disAddr,rawdiss,sizeof(rawdiss)))
+         return 1;
 
       unsigned char instruction=0;
       unsigned char rex=0;
@@ -450,7 +527,7 @@ static void getArguments64(const mxProc *proc, Elf_Addr disAddr, Elf_Addr rbp, i
       signed int *addroff4=0;
       int addrLength=0;
 
-      verbose && printf(FMT_ADR ": ", (unsigned long)disAddr);
+      verbose && fprintf(getOutputFile(), FMT_ADR ": ", (unsigned long)disAddr);
       if (rawdiss[0] == 0xf2 && rawdiss[1] == 0x0f && rawdiss[2] == 0x11)  // movsd
       {
          instruction=rawdiss[2];
@@ -479,77 +556,123 @@ static void getArguments64(const mxProc *proc, Elf_Addr disAddr, Elf_Addr rbp, i
       }
 
       // first two bits of modrm tell us if it's a 8 bit or 32bit offset
-      Elf_Addr argAddr = 0x0;
+      long argOffset = 0;
       if ((modrm & 0xc0) == 0x40)
       {
-         argAddr = rbp + *addroff1;
+         argOffset = *addroff1;
          addrLength = 1;
       }
       else if ((modrm & 0xc0) == 0x80)
       {
-         argAddr = rbp + *addroff4;
+         argOffset = *addroff4;
          addrLength = 4;
       }
       else
       {
          debug("print register offset");
-         return;
+         return 0;
       }
       disAddr += addrLength;
 
 
       if (instruction==0x89 && (rex & 0x48) == 0x48) // movq 64bit reg
       {
-         verbose && printf("movq     ");
+         verbose && fprintf(getOutputFile(), "movq     ");
          int argNo = getArgNumber(rex,modrm,verbose);
          if (argNo >= 0)
-            addIntArgument(proc, args, argNo, argAddr, 8);
+            addPrologueSlot(prologue, argNo, 0, argOffset, 8);
       }
       else if (instruction==0x89) // movl 32bit reg
       {
-         verbose && printf("movl     ");
+         verbose && fprintf(getOutputFile(), "movl     ");
          int argNo = getArgNumber(rex,modrm,verbose);
          if (argNo >= 0)
-            addIntArgument(proc, args, argNo, argAddr, 4);
+            addPrologueSlot(prologue, argNo, 0, argOffset, 4);
       }
       else if (instruction==0x88) // movb 8bit Reg
       {
-         verbose && printf("movb     ");
+         verbose && fprintf(getOutputFile(), "movb     ");
          int argNo = getArgNumber(rex,modrm,verbose);
          if (argNo >= 0)
-            addIntArgument(proc, args, argNo, argAddr, 1);
+            addPrologueSlot(prologue, argNo, 0, argOffset, 1);
       }
       else if (instruction==0x11) // movsd - double
       {
-         verbose && printf("movsd    ");
+         verbose && fprintf(getOutputFile(), "movsd    ");
          int argNo = getFloatArgNumber(rex,modrm,verbose);
          if (argNo >= 0)
-            addFloatArgument(proc, args, argNo, argAddr, 8);
+            addPrologueSlot(prologue, argNo, 1, argOffset, 8);
       }
       else
          break;
 
 
       if (addrLength==1)
-         verbose && printf(",0x%hhx(%%rbp)\n", *addroff1);
+         verbose && fprintf(getOutputFile(), ",0x%hhx(%%rbp)\n", *addroff1);
+      else
+         verbose && fprintf(getOutputFile(), ",0x%x(%%rbp)\n", *addroff4);
+   }
+
+   verbose && fprintf(getOutputFile(), "finished decompiling\n");
+   return 0;
+}
+
+static void getArguments64(const mxProc *proc, Elf_Addr disAddr, Elf_Addr rbp, int verbose, mxArguments *args)
+{
+   // The disassembly is only printed when decoding, so don't use the cache when verbose
+   mxPrologue_t decoded;
+   const mxPrologue_t *prologue = &decoded;
+
+   if (verbose || getCachedPrologue(proc, disAddr, &decoded))
+   {
+      decoded.function = disAddr;
+      decoded.nSlots = 0;
+      // A read failure leaves the prologue incomplete, so decode it again next time
+      if (!decodeArguments64(proc, disAddr, verbose, &decoded) && disAddr && !verbose)
+         cachePrologue(proc, &decoded);
+   }
+
+   mxReadRequest requests[MAX_REG_ARGS];
+   int nRequests = 0;
+
+   // The requests point into the argument arrays, so size them before queueing any
+   for (int i = 0; i < prologue->nSlots; i++)
+   {
+      const mxPrologueSlot_t *slot = prologue->slot + i;
+      if (slot->isFloat)
+         reserveArguments(&args->floatArg, &args->maxFloatArgs, slot->argNo + 1);
+      else
+         reserveArguments(&args->intArg, &args->maxIntArgs, slot->argNo + 1);
+   }
+
+   for (int i = 0; i < prologue->nSlots; i++)
+   {
+      const mxPrologueSlot_t *slot = prologue->slot + i;
+      if (slot->isFloat)
+         queueArgument(requests, &nRequests, &(args->floatArg[slot->argNo]), &(args->floatCount), slot->argNo, rbp + slot->offset, slot->size);
       else
-         verbose && printf(",0x%x(%%rbp)\n", *addroff4);
+         queueArgument(requests, &nRequests, &(args->intArg[slot->argNo]), &(args->intCount), slot->argNo, rbp + slot->offset, slot->size);
    }
 
-   verbose && printf("finished decompiling\n");
-   return;
+   readMxProcVMBatch(proc, requests, nRequests);
+
+   for (int i = 0; i < nRequests; i++)
+   {
+      if (requests[i].status)
+         debug("Error reading register argument from " FMT_ADR, requests[i].vmAddr);
+      debug("Added Register Argument size %d bytes from Address " FMT_ADR " with value " FMT_ADR, (int) requests[i].size, requests[i].vmAddr, *static_cast<unsigned long *>(requests[i].buff));
+   }
 }
 
 mxArguments *getArguments(const mxProc *proc, Elf_Addr disAddr, Elf_Addr frameAddr, int verbose)
 {
-   mxArguments *args = reinterpret_cast<mxArguments *>(calloc(sizeof(mxArguments),1));
+   mxArguments *args = newArguments();
 
 #if defined (_LP64)
    getArguments64(proc,disAddr,frameAddr,verbose, args);
 #endif
 
-   for (int i=0 ; i<MAX_ARGS; i++)
-      addStackArgument(proc, args, i, frameAddr + (2+i)*sizeof(long), sizeof(long));
+   addStackArguments(proc, args, frameAddr + 2*sizeof(long), MAX_ARGS, sizeof(long));
 
    return args;
 }
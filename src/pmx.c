@@ -8,10 +8,12 @@
 *
 *******************************************************************************/
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <set>
 #include <string.h>
+#include <unistd.h>
 
 #include "mxProcUtils.h"
 #include "pmx.h"
@@ -20,6 +22,40 @@ static int inlineMode=0;
 
 static int printArgv=0; // enabler flag for  print_main_argv
 
+// What has been printed so far.  Only the main thread uses these.  --jobs workers defer to it, see emitDeferredOutput().
+static std::set<Elf_Addr> processed; // Keep a set of the addresses already displayed
+static int stringCounter = 0;
+static int warnedCorruptHeap = 0;
+static int warnedJVMFull = 0;
+
+// Output of an item printed by a --jobs worker.  Whether an argument or warning is printed and how string
+// files are numbered depends on everything printed before it, so the worker marks where that applies and
+// emitDeferredOutput() decides, in order, on the main thread.
+enum { DEFER_ARGUMENT, DEFER_ONCE, DEFER_STRING_FILE };
+
+typedef struct
+{
+   int type;
+   long start;          // Offsets in the buffered output
+   long end;
+   Elf_Addr key;        // Address of the argument, or of the warned flag for DEFER_ONCE
+   int insert;          // Add the argument to processed once it is printed
+   int nested;          // Events recorded while this one was printed, which follow it
+   char *fileName;      // Where the string was written, NULL if it couldn't be
+}
+pmxDeferredEvent_t;
+
+struct pmxDeferredOutput
+{
+   FILE *fp;
+   int nEvents;
+   int maxEvents;
+   pmxDeferredEvent_t *event;
+};
+
+static __thread pmxDeferredOutput_t *deferred = NULL;
+static int deferredFiles = 0;
+
 // Note that almost all structures are passed as pointes.  Make sure you include * in the definition below.
 static TypePrinterEntry *type_printer_for_type = NULL;
 static TypePrinterEntry type_printer_default[] = {
@@ -71,6 +107,153 @@ static FunctionPrinterEntry function_printers[] = {
    { NULL, NULL}
 };
 
+void startDeferredOutput(FILE *fp)
+{
+   deferred = static_cast<pmxDeferredOutput_t *>(calloc(1, sizeof(pmxDeferredOutput_t)));
+   deferred->fp = fp;
+   setOutputFile(fp);
+}
+
+pmxDeferredOutput_t *finishDeferredOutput()
+{
+   pmxDeferredOutput_t *d = deferred;
+   setOutputFile(NULL);
+   deferred = NULL;
+   return d;
+}
+
+static int beginDeferred(int type, Elf_Addr key)
+{
+   // Returns the index of the event, as printing inside it can move the array
+   deferred->event = static_cast<pmxDeferredEvent_t *>(growArray(deferred->event, &deferred->maxEvents, sizeof(pmxDeferredEvent_t), deferred->nEvents + 1));
+   pmxDeferredEvent_t *e = deferred->event + deferred->nEvents;
+   e->type = type;
+   e->start = e->end = ftell(deferred->fp);
+   e->key = key;
+   e->insert = 0;
+   e->nested = 0;
+   e->fileName = NULL;
+   return deferred->nEvents++;
+}
+
+static void endDeferred(int i)
+{
+   deferred->event[i].end = ftell(deferred->fp);
+   deferred->event[i].nested = deferred->nEvents - 1 - i;
+}
+
+static void copyDeferred(FILE *fp, FILE *out, long size)
+{
+   char buff[65536];
+   while (size > 0)
+   {
+      size_t n = fread(buff, 1, (size_t) size < sizeof(buff) ? size : sizeof(buff), fp);
+      if (!n)
+         break;
+      fwrite(buff, 1, n, out);
+      size -= n;
+   }
+}
+
+void emitDeferredOutput(const mxProc *proc, pmxDeferredOutput_t *d, FILE *out)
+{
+   // Writes out the output of a --jobs worker as if it had been printed by the main thread.  As when printing
+   // serially, an argument is only added to processed once everything printed inside it is done.
+   long pos = 0;
+   int skipTo = -1;      // Last event inside output which was skipped
+   int nOpen = 0;
+   int *open = static_cast<int *>(malloc((d->nEvents + 1) * sizeof(int)));  // Arguments being printed, innermost last
+   rewind(d->fp);
+   setOutputFile(out);
+
+   for (int i = 0; i <= d->nEvents; i++)
+   {
+      // Arguments whose output is complete
+      while (nOpen && open[nOpen - 1] + d->event[open[nOpen - 1]].nested < i)
+      {
+         pmxDeferredEvent_t *e = d->event + open[--nOpen];
+         if (e->insert)
+            processed.insert(e->key);
+      }
+      if (i == d->nEvents)
+         break;
+
+      pmxDeferredEvent_t *e = d->event + i;
+      if (i <= skipTo)
+      {
+         if (e->fileName)
+            unlink(e->fileName);
+         free(e->fileName);
+         continue;
+      }
+
+      copyDeferred(d->fp, out, e->start - pos);
+      pos = e->start;
+
+      int skip = 0;
+      if (e->type == DEFER_ARGUMENT)
+      {
+         if (processed.find(e->key) != processed.end())
+         {
+            debug("Skipping argument as we have already processed " FMT_ADR, e->key);
+            skip = 1;
+         }
+         else
+            open[nOpen++] = i;
+      }
+      else if (e->type == DEFER_ONCE)
+      {
+         skip = (*reinterpret_cast<int *>(e->key))++;
+      }
+      else
+      {
+         char fileName[sizeof(proc->filePrefix) + 16];
+         snprintf(fileName,sizeof(fileName),"%s.%d.txt",proc->filePrefix,stringCounter++);
+         if (e->fileName)
+         {
+            if (rename(e->fileName, fileName))
+               warning("Failed to rename %s to %s", e->fileName, fileName);
+            fputs(fileName, out);
+            free(e->fileName);
+         }
+      }
+
+      if (skip)
+      {
+         fseek(d->fp, e->end, SEEK_SET);
+         pos = e->end;
+         skipTo = i + e->nested;
+      }
+   }
+
+   copyDeferred(d->fp, out, LONG_MAX);
+   setOutputFile(NULL);
+   fclose(d->fp);
+   free(open);
+   free(d->event);
+   free(d);
+}
+
+static void warnOnce(int *warned, const char *message)
+{
+   // --jobs workers always warn, and emitDeferredOutput() drops the repeats
+   if (deferred)
+   {
+      int e = beginDeferred(DEFER_ONCE, (Elf_Addr) warned);
+      warning("%s", message);
+      endDeferred(e);
+   }
+   else if (!(*warned)++)
+   {
+      warning("%s", message);
+   }
+}
+
+void freePrintState()
+{
+   freeArgumentArena();
+}
+
 int append_type_printers(TypePrinterEntry *ext)
 {
    debug("Appending type printers");
@@ -156,12 +339,12 @@ void print_double(const char *function_name, const char *type, const mxProc * pr
    {
       Elf_Addr a = read_addr(proc, offset);
       double v = read_double(proc, a);
-      printf("%s: %s=%f (at 0x%x)\n", function_name, type, v, a);
+      fprintf(getOutputFile(), "%s: %s=%f (at 0x%x)\n", function_name, type, v, a);
    }
    else
    {
       double v = read_double(proc, offset);
-      printf("%s: %s=%f\n", function_name, type, v);
+      fprintf(getOutputFile(), "%s: %s=%f\n", function_name, type, v);
    }
 }
 
@@ -171,12 +354,12 @@ void print_long(const char *function_name, const char *type, const mxProc * proc
    {
       Elf_Addr a = read_addr(proc, offset);
       long v = read_long(proc, a);
-      printf("%s: %s=%ld (at 0x%x)\n", function_name, type, v, a);
+      fprintf(getOutputFile(), "%s: %s=%ld (at 0x%x)\n", function_name, type, v, a);
    }
    else
    {
       long v = read_long(proc, offset);
-      printf("%s: %s=%ld\n", function_name, type, v);
+      fprintf(getOutputFile(), "%s: %s=%ld\n", function_name, type, v);
    }
 }
 
@@ -186,12 +369,12 @@ void print_int(const char *function_name, const char *type, const mxProc * proc,
    {
       Elf_Addr a = read_addr(proc, offset);
       int v = read_int(proc, a);
-      printf("%s: %s=%d (at 0x%x)\n", function_name, type, v, a);
+      fprintf(getOutputFile(), "%s: %s=%d (at 0x%x)\n", function_name, type, v, a);
    }
    else
    {
       int v = read_int(proc, offset);
-      printf("%s: %s=%d\n", function_name, type, v);
+      fprintf(getOutputFile(), "%s: %s=%d\n", function_name, type, v);
    }
 }
 
@@ -199,7 +382,25 @@ void print_double_with_decimal(const char *function_name, const char *type, mxPr
 {
    double v = read_double(proc, offset);
 
-   printf("%s: %s=%f\n", function_name, type, v);
+   fprintf(getOutputFile(), "%s: %s=%f\n", function_name, type, v);
+}
+
+// Copies the rest of a string to fp a chunk at a time, reading no more than limit characters.
+// Returns the number of characters copied.
+static size_t stream_string(const mxProc * proc, Elf_Addr offset, size_t limit, FILE *fp)
+{
+   char chunk[16384];
+   size_t length = 0;
+   int complete = 0;
+
+   while (!complete && length < limit)
+   {
+      size_t n = read_string_part(proc, offset + length, chunk, (limit - length < sizeof(chunk) ? limit - length : sizeof(chunk)), &complete);
+      fwrite(chunk, sizeof(char), n, fp);
+      length += n;
+   }
+
+   return length;
 }
 
 void print_string(const char *function_name, const char *type, const mxProc * proc, Elf_Addr offset, int skipIfEmpty, int maxLength)
@@ -209,29 +410,33 @@ void print_string(const char *function_name, const char *type, const mxProc * pr
 #else
    int maxString = 1024 * 1024 * 100; // 100M
 #endif
+   const size_t maxInline = 1024;
 
    if (!offset)
    {
       // For now, skipIfEmpty only applies to empty strings, not NULL pointers
-      printf("%s: %s=NULL\n", function_name, type);
+      fprintf(getOutputFile(), "%s: %s=NULL\n", function_name, type);
       return;
    }
 
-   char *v = (char *)malloc(maxString);
-
-   size_t strLength = 0;
-
-   read_string(proc, offset, v, (maxLength ? maxLength : maxString));
-   strLength = strlen(v);
-
-   if (strLength == maxString-1)
-      warning("String truncated to %dMB", maxString/(1024*1024));
-
-   if (getInlineMode()==0 && (strLength > 1024 || strchr(v,'\n')))
+   // Only the start of the string is kept in memory.  That is enough to decide whether it
+   // can be printed inline, and anything longer is streamed straight to its destination.
+   size_t limit = (maxLength ? maxLength : maxString) - 1;
+   char head[maxInline + 2];
+   int complete = 0;
+   size_t strLength = read_string_part(proc, offset, head, (limit < maxInline + 1 ? limit : maxInline + 1), &complete);
+   head[strLength] = '\0';
+   if (strLength == limit)
+      complete = 1;
+
+   if (getInlineMode()==0 && (strLength > maxInline || strchr(head,'\n')))
    {
-      char fileName[1024];
-      static int stringCounter = 0;
-      snprintf(fileName,sizeof(fileName),"%s.%d.txt",proc->filePrefix,stringCounter++);
+      // --jobs workers write to a temporary file, which is renamed once its number is known
+      char fileName[sizeof(proc->filePrefix) + 32];
+      if (deferred)
+         snprintf(fileName,sizeof(fileName),"%s.part%d.txt",proc->filePrefix,__sync_fetch_and_add(&deferredFiles, 1));
+      else
+         snprintf(fileName,sizeof(fileName),"%s.%d.txt",proc->filePrefix,stringCounter++);
 #if defined(__sun) && !defined (_LP64)
       FILE *fp = fopen(fileName,"wF");
 #else
@@ -240,19 +445,43 @@ void print_string(const char *function_name, const char *type, const mxProc * pr
       if (!fp)
       {
          warning("Failed to open %s for output. Maybe you need to add -p to the command line.",fileName);
-         free(v);
+         if (deferred)
+            beginDeferred(DEFER_STRING_FILE, 0);  // The number is still used up
          return;
       }
 
-      printf("%s: %s written to %s (%ld bytes)\n", function_name, type, fileName, (long) strLength);
-      fwrite(v, sizeof(char), strlen(v), fp);  // We don't use fprintf as it upsets the security scanner
+      fwrite(head, sizeof(char), strLength, fp);  // We don't use fprintf as it upsets the security scanner
+      if (!complete)
+         strLength += stream_string(proc, offset + strLength, limit - strLength, fp);
       fclose(fp);
+
+      if (strLength == maxString-1)
+         warning("String truncated to %dMB", maxString/(1024*1024));
+      if (deferred)
+      {
+         fprintf(getOutputFile(), "%s: %s written to ", function_name, type);
+         int e = beginDeferred(DEFER_STRING_FILE, 0);
+         deferred->event[e].fileName = strdup(fileName);
+         fprintf(getOutputFile(), " (%ld bytes)\n", (long) strLength);
+      }
+      else
+      {
+         fprintf(getOutputFile(), "%s: %s written to %s (%ld bytes)\n", function_name, type, fileName, (long) strLength);
+      }
    }
-   else if(!skipIfEmpty || v[0])
+   else if (!complete)
    {
-      printf("%s: %s=\"%s\"\n", function_name, type, v);
+      // Inline mode, so a long string still goes to the output file in one piece
+      fprintf(getOutputFile(), "%s: %s=\"%s", function_name, type, head);
+      strLength += stream_string(proc, offset + strLength, limit - strLength, getOutputFile());
+      fprintf(getOutputFile(), "\"\n");
+      if (strLength == maxString-1)
+         warning("String truncated to %dMB", maxString/(1024*1024));
+   }
+   else if(!skipIfEmpty || head[0])
+   {
+      fprintf(getOutputFile(), "%s: %s=\"%s\"\n", function_name, type, head);
    }
-   free(v);
 }
 
 void print_string(const char *function_name, const char *type, const mxProc * proc, Elf_Addr offset, int skipIfEmpty)
@@ -273,7 +502,7 @@ void print_string_pointer(const char *function_name, const char *type, const mxP
 
 void print_null(const mxProc * proc, const char *name, const char *comment)
 {
-   printf("%s: %s=NULL\n", name, comment);
+   fprintf(getOutputFile(), "%s: %s=NULL\n", name, comment);
 }
 
 void print_double_pointer(const mxProc * proc, const char *name, const char *comment, Elf_Addr value)
@@ -284,7 +513,7 @@ void print_double_pointer(const mxProc * proc, const char *name, const char *com
 void print_double_argument(const mxProc * proc, const char *name, const char *comment, Elf_Addr value)
 {
    // This is to print a string that's passed in by value, not reference
-   printf("%s: %s=%f\n",name, comment, static_cast<double>(value));
+   fprintf(getOutputFile(), "%s: %s=%f\n",name, comment, static_cast<double>(value));
 }
 
 void print_int_pointer(const mxProc * proc, const char *name, const char *comment, Elf_Addr value)
@@ -295,13 +524,13 @@ void print_int_pointer(const mxProc * proc, const char *name, const char *commen
 void print_int_argument(const mxProc * proc, const char *name, const char *comment, Elf_Addr value)
 {
    // This is to print a string that's passed in by value, not reference
-   printf("%s: %s=%d\n",name, comment, (int)value);
+   fprintf(getOutputFile(), "%s: %s=%d\n",name, comment, (int)value);
 }
 
 void print_void_pointer(const mxProc * proc, const char *name, const char *comment, Elf_Addr value)
 {
    Elf_Addr addr = read_addr(proc, value);
-   printf("%s: %s=" FMT_ADR "\n", name, comment, (unsigned long)addr);
+   fprintf(getOutputFile(), "%s: %s=" FMT_ADR "\n", name, comment, (unsigned long)addr);
 }
 
 void print_string_argument(const mxProc * proc, const char *name, const char *comment, Elf_Addr value)
@@ -344,8 +573,6 @@ void display_arguments(const mxProc * proc, const char *name, mxArguments *args)
 
    debug("looking for printer functions for function %s", name);
 
-   static std::set<Elf_Addr> processed; // Keep a set of the addresses already displayed
-
    StackHandler *entry;
    char tmp_label[100];
    const char *type_name = args->arg[0].type;
@@ -356,10 +583,11 @@ void display_arguments(const mxProc * proc, const char *name, mxArguments *args)
 
       if (args->arg[i].size == 0)
          debug("Skipping uninitialised argument %d", i);
-      else if (processed.find(val) != processed.end())
+      else if (!deferred && processed.find(val) != processed.end())
          debug("Skipping argument as we have already processed " FMT_ADR, val);
       else
       {
+         int region = deferred ? beginDeferred(DEFER_ARGUMENT, val) : 0;
          debug("looking for printer function for type %s", type_name);
          entry = lookup_print_function(type_name, true);
          if (entry)
@@ -369,13 +597,18 @@ void display_arguments(const mxProc * proc, const char *name, mxArguments *args)
             if (val)
             {
                entry(proc, name, tmp_label, val);
-               processed.insert(val);
+               if (deferred)
+                  deferred->event[region].insert = 1;
+               else
+                  processed.insert(val);
             }
             else
             {
                print_null(proc, name, tmp_label);
             }
          }
+         if (deferred)
+            endDeferred(region);
       }
       i++;
       type_name = args->arg[i].type;
@@ -388,10 +621,10 @@ void display_type_printers()
    TypePrinterEntry *entry = type_printer_for_type;
    while (entry->type_name != NULL)
    {
-      printf("    %s", entry->type_name);
+      fprintf(getOutputFile(), "    %s", entry->type_name);
       if (entry->comment)
-         printf(" (%s)",entry->comment);
-      printf("\n");
+         fprintf(getOutputFile(), " (%s)",entry->comment);
+      fprintf(getOutputFile(), "\n");
       entry++;
    }
 }
@@ -417,11 +650,11 @@ int print_mxargv(const mxProc *proc, Elf_Addr argc_addr, Elf_Addr argv, Elf_Addr
       {
          char v[256];
          read_string(proc, arg, v, sizeof(v));
-         printf("arg_x[%d]='%s'\n",i,v);
+         fprintf(getOutputFile(), "arg_x[%d]='%s'\n",i,v);
          i++;
       }
    }
-   printf("\n");
+   fprintf(getOutputFile(), "\n");
    return 0;
 }
 
@@ -438,7 +671,7 @@ static void print_argv(const mxProc *proc, int argc, Elf_Addr argv)
       char v[256];
       Elf_Addr arg = read_addr(proc, argv + i * sizeof(Elf_Addr));
       read_string(proc, arg, v, sizeof(v));
-      printf("argv[%d]='%s'\n",i,v);
+      fprintf(getOutputFile(), "argv[%d]='%s'\n",i,v);
    }
 }
 
@@ -468,22 +701,22 @@ void print_raw1k(const mxProc *proc, const char *name, const char *comment, Elf_
    {
       if (readMxProcVM(proc, addr, &raw, perLine))
       {
-         printf("Unable to print 1k raw data");
+         fprintf(getOutputFile(), "Unable to print 1k raw data");
          return;
       }
 
       //Address
-      printf(FMT_ADR": ",(unsigned long)addr);
+      fprintf(getOutputFile(), FMT_ADR": ",(unsigned long)addr);
 
       //Hex
       for (int j=0; j<perLine; j++)
-         printf("%02x ",(unsigned int)raw[j]);
-      printf(" ");
+         fprintf(getOutputFile(), "%02x ",(unsigned int)raw[j]);
+      fprintf(getOutputFile(), " ");
 
       //Raw char
       for (int j=0; j<perLine; j++)
-         printf("%c",raw[j]);
-      printf("\n");
+         fprintf(getOutputFile(), "%c",raw[j]);
+      fprintf(getOutputFile(), "\n");
 
 
       addr+=perLine;
@@ -494,25 +727,22 @@ void print_disassemble(const mxProc *proc, const char *name, const char *comment
 {
 #if defined (_LP64) && (__x86_64)
    getArguments(proc,disAddr,0x0,1);
+   releaseArguments();
 #else
-   printf("Disassembly only supported on x86 64bit\n");
+   fprintf(getOutputFile(), "Disassembly only supported on x86 64bit\n");
 #endif
 }
 
 int print_corrupt_heap(const mxProc * proc, const char *name, const char *comment, mxArguments *args)
 {
-   static int warned=0;
-   if (! warned++)
-      warning("Heap memory corruption has been detected. Analysis with Purify/Valgrind is required.");
+   warnOnce(&warnedCorruptHeap, "Heap memory corruption has been detected. Analysis with Purify/Valgrind is required.");
 
    return 1;
 }
 
 int print_jvm_full(const mxProc * proc, const char *name, const char *comment, mxArguments *args)
 {
-   static int warned=0;
-   if (! warned++)
-      warning("JVM heap may be full. Consider increasing /MXJ_JVM:-Xmx to a higher value.");
+   warnOnce(&warnedJVMFull, "JVM heap may be full. Consider increasing /MXJ_JVM:-Xmx to a higher value.");
 
    return 1;
 }
@@ -554,17 +784,17 @@ int print_libc_message(const mxProc * proc, const char *name, const char *commen
          {
             char stringArg[10240]= {0};
             read_string(proc, args->arg[1+argNo].val.val, stringArg, sizeof(stringArg));
-            printf("%s",stringArg);
+            fprintf(getOutputFile(), "%s",stringArg);
          } 
          else
          {
-            printf("== arg type %c unsupported by pmx ==",*c);
+            fprintf(getOutputFile(), "== arg type %c unsupported by pmx ==",*c);
          }
          c++;
       } 
       else
       {
-         printf("%c",*c);
+         fprintf(getOutputFile(), "%c",*c);
          c++;
       }
    }
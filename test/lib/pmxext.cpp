@@ -14,6 +14,8 @@
 #include "structFOO.h"
 #include "types_FOO.h"
 
+PMX_EXTENSION_ABI_VERSION;
+
 extern "C" {
 
 TypePrinterEntry type_printer_extension[] = {